@@ -1,4 +1,5 @@
 #define CHUNK_SIZE	(4<<20)
+#define DICT_SIZE	(64<<10)
 #define likely(cond)	__builtin_expect((cond), 1)
 #define unlikely(cond)	__builtin_expect((cond), 0)
 #define true		1
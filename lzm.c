@@ -13,11 +13,31 @@
 #include <string.h>
 #include <fts.h>
 #include <errno.h>
+#include <getopt.h>
 
 #include "conf.h"
 #include "lzm.h"
 
 #define LZM_NO_COMPRESSION (0x80000000UL)
+#define LZM_LINKED (0x80000000UL)
+#define LZM_DICT (0x40000000UL)
+
+enum opttype { LEVEL = 256, FAST, FORMAT, DICTIONARY, DICTIONARY_SIZE,
+    TRAIN, LONG, CACHE, SAMPLE, PREFETCH };
+
+static struct option long_opts[] = {
+    { "level",		required_argument,	NULL,	LEVEL		},
+    { "fast",		required_argument,	NULL,	FAST		},
+    { "format",		required_argument,	NULL,	FORMAT		},
+    { "dict",		required_argument,	NULL,	DICTIONARY	},
+    { "dict-size",	required_argument,	NULL,	DICTIONARY_SIZE	},
+    { "train",		required_argument,	NULL,	TRAIN		},
+    { "long",		no_argument,		NULL,	LONG		},
+    { "cache",		required_argument,	NULL,	CACHE		},
+    { "sample",		required_argument,	NULL,	SAMPLE		},
+    { "prefetch",	no_argument,		NULL,	PREFETCH	},
+    { NULL,		no_argument,		NULL,	0		},
+};
 
 long pagesize;
 
@@ -29,6 +49,14 @@ struct compress_args {
 	unsigned int format;
 	unsigned int level;
 	unsigned int chunk_size;
+	unsigned int window;
+	unsigned int ldm;
+	unsigned int sample;
+	unsigned int prefetch;
+	unsigned char *dict;
+	unsigned int dict_size;
+	unsigned int train_size;
+	char *train;
 	unsigned int console;
 	unsigned int clobber;
 	unsigned int recurse;
@@ -39,13 +67,60 @@ struct compress_args {
 	unsigned int bench_tests;
 };
 
+/*
+ * Parse the --cache list of L1, L2 and L3 sizes in KB, a zero keeps the
+ * detected size for that cache.
+ */
+static unsigned int
+set_cache_sizes(const char *arg)
+{
+	unsigned long size;
+	unsigned int cache;
+	char *end;
+
+	for (cache = LZM_CACHE_L1; cache < LZM_CACHE_COUNT; cache++) {
+		size = strtoul(arg, &end, 0);
+		if (end == arg || size > (~0U >> 10))
+			return EINVAL;
+		if (*end != (cache == LZM_CACHE_L3 ? '\0' : ','))
+			return EINVAL;
+		lzm_set_cache_size(cache, size << 10);
+		arg = end + 1;
+	}
+
+	return 0;
+}
+
 static void
 usage(void)
 {
 	printf("usage: lzm [options] <files...>\n");
 	printf("	-0		no compression\n");
 	printf("	-1		fast compression\n");
-	printf("	-2 .. -6	high compression\n");
+	printf("	-2 .. -7	high compression\n");
+	printf("	-8 .. -9	optimal parsing, slowest\n");
+	printf("	--level <n>	any level, 10-11 are lazy matching between\n");
+	printf("			fast and high compression, 12-13 lazy\n");
+	printf("			matching over bucketed hash tables, 14 is\n");
+	printf("			fast with a second table for long matches,\n");
+	printf("			19 is optimal parsing for decode speed\n");
+	printf("	--fast <n>	accelerated levels 1-%d, faster than -1 with\n",
+	    LZM_ACCEL_COUNT);
+	printf("			less compression, same as --level %d-%d\n",
+	    LZM_LEVEL_ACCEL, LZM_LEVEL_ACCEL + LZM_ACCEL_COUNT - 1);
+	printf("	--format <n>	stream format, 2 adds repeat offsets\n");
+	printf("	--dict <file>	(de)compress using a dictionary\n");
+	printf("	--train <file>	train a dictionary from the sample files\n");
+	printf("	--dict-size <n>	maximum size of a trained dictionary (KB)\n");
+	printf("	--long		find repeats anywhere in the window, implies\n");
+	printf("			-w %d unless given\n", LZM_WINDOW_MAX >> 20);
+	printf("	--cache <l1,l2,l3> size tables for these cache sizes (KB)\n");
+	printf("			instead of the detected ones, 0 keeps one\n");
+	printf("	--sample <n>	store chunks where under n%% of sampled data\n");
+	printf("			repeats, default %d, 0 compresses all\n",
+	    LZM_SAMPLE_DEF);
+	printf("	--prefetch	decompress in batches prefetching matches,\n");
+	printf("			for far repeats over a large -x or -w\n");
 	printf("	-c		write output to stdout\n");
 	printf("	-b <tests>	benchmark mode\n");
 	printf("	-d		decompress file\n");
@@ -55,6 +130,7 @@ usage(void)
 	printf("	-t		test compressed file\n");
 	printf("	-v		be verbose\n");
 	printf("	-h		this help message\n");
+	printf("	-w <size>	link chunks with a history window (MB)\n");
 	printf("	-x <size>	chunk size for compression (KB)\n");
 }
 
@@ -112,8 +188,21 @@ compress_fd(const int fd_in, const int fd_out,
 	unsigned int size_flag;
 	unsigned int write_size;
 	unsigned int header;
+	unsigned int format;
+	unsigned int out_size;
+	unsigned int dict_id;
+	unsigned int hash_order;
+	unsigned int chain_order;
 	int ret;
 
+	/*
+	 * The output buffer holds the worst case so the encoder can skip its
+	 * bounds checks.  Chunks that come out larger than the chunk size are
+	 * stored raw, unless linked as the decoder would not see them as
+	 * history.
+	 */
+	out_size = lzm_encode_bound(args->chunk_size);
+
 	ret = posix_memalign((void **)&buffer_in, pagesize, args->chunk_size);
 	if (ret != 0) {
 		ret = ENOMEM;
@@ -122,21 +211,39 @@ compress_fd(const int fd_in, const int fd_out,
 		goto out;
 	}
 
-	ret = posix_memalign((void **)&buffer_out, pagesize, args->chunk_size);
+	ret = posix_memalign((void **)&buffer_out, pagesize, out_size);
 	if (ret != 0) {
 		ret = ENOMEM;
 		fprintf(stderr, "File %s: failed to allocate %d bytes: %s\n",
-		    args->filename, args->chunk_size, strerror(ret));
+		    args->filename, out_size, strerror(ret));
 		goto out;
 	}
 
-	ret = lzm_encode_init(&state, args->format, args->level);
+	if (args->ldm == true)
+		ret = lzm_encode_init_long(&state, args->format, args->level,
+		    args->window);
+	else if (args->window != 0)
+		ret = lzm_encode_init_stream(&state, args->format, args->level,
+		    args->window);
+	else if (args->dict != NULL)
+		ret = lzm_encode_init_dict(&state, args->format, args->level,
+		    args->dict, args->dict_size);
+	else
+		ret = lzm_encode_init(&state, args->format, args->level);
+	if (ret == 0)
+		ret = lzm_encode_set_sample(state, args->sample);
 	if (ret != 0) {
 		fprintf(stderr, "File %s: failed to init lzm: %s\n",
 		    args->filename, strerror(ret));
 		goto out;
 	}
 
+	if (args->verbose == true && fd_out != STDOUT_FILENO) {
+		lzm_encode_orders(state, &hash_order, &chain_order);
+		printf("Compressing %s: hash order %u, chain order %u\n",
+		    args->filename, hash_order, chain_order);
+	}
+
 	header = HEADER_VALUE;
 	ret = write_data(fd_out, &header, sizeof(header));
 	if (ret != 0) {
@@ -147,14 +254,20 @@ compress_fd(const int fd_in, const int fd_out,
 
 	total_out += sizeof(header);
 
-	ret = write_data(fd_out, &args->format, sizeof(args->format));
+	format = args->format;
+	if (args->window != 0)
+		format |= LZM_LINKED;
+	if (args->dict != NULL)
+		format |= LZM_DICT;
+
+	ret = write_data(fd_out, &format, sizeof(format));
 	if (ret != 0) {
 		fprintf(stderr, "File %s: failed to write data: %s\n",
 		    args->filename_out, strerror(ret));
 		goto out;
 	}
 
-	total_out += sizeof(args->format);
+	total_out += sizeof(format);
 
 	ret = write_data(fd_out, &args->chunk_size, sizeof(args->chunk_size));
 	if (ret != 0) {
@@ -165,6 +278,29 @@ compress_fd(const int fd_in, const int fd_out,
 
 	total_out += sizeof(args->chunk_size);
 
+	if (args->window != 0) {
+		ret = write_data(fd_out, &args->window, sizeof(args->window));
+		if (ret != 0) {
+			fprintf(stderr, "File %s: failed to write data: %s\n",
+			    args->filename_out, strerror(ret));
+			goto out;
+		}
+
+		total_out += sizeof(args->window);
+	}
+
+	if (args->dict != NULL) {
+		dict_id = lzm_dict_id(args->dict, args->dict_size);
+		ret = write_data(fd_out, &dict_id, sizeof(dict_id));
+		if (ret != 0) {
+			fprintf(stderr, "File %s: failed to write data: %s\n",
+			    args->filename_out, strerror(ret));
+			goto out;
+		}
+
+		total_out += sizeof(dict_id);
+	}
+
 	for (;;) {
 
 		size_in = args->chunk_size;
@@ -178,12 +314,14 @@ compress_fd(const int fd_in, const int fd_out,
 		if (size_in == 0)
 			break;
 
-		size_out = args->chunk_size;
+		size_out = out_size;
 		size_flag = 0;
 		write_buffer = buffer_out;
 		ret = lzm_encode(state, buffer_in, size_in, buffer_out,
 		    &size_out);
-		if (ret == EOVERFLOW &&
+		if ((ret == EOVERFLOW ||
+		    (ret == 0 && size_out > args->chunk_size)) &&
+		    args->window == 0 &&
 		    args->chunk_size < LZM_NO_COMPRESSION) {
 			size_out = size_in;
 			size_flag = LZM_NO_COMPRESSION;
@@ -241,8 +379,8 @@ decompress_fd(const int fd_in, const int fd_out,
     struct compress_args * const args)
 {
 	struct lzm_state *state = NULL;
-	unsigned char *buffer_in = NULL;
-	unsigned char *buffer_out = NULL;
+	unsigned char *buffer = NULL;
+	unsigned char *buffer_in;
 	unsigned char *write_buffer = NULL;
 	off_t total_in = 0;
 	off_t total_out = 0;
@@ -251,6 +389,10 @@ decompress_fd(const int fd_in, const int fd_out,
 	unsigned int header;
 	unsigned int bytes;
 	unsigned int no_compression;
+	unsigned int in_size;
+	unsigned int buffer_size;
+	unsigned int dict_id;
+	unsigned int use_dict;
 	int ret;
 
 	bytes = sizeof(header);
@@ -318,25 +460,96 @@ decompress_fd(const int fd_in, const int fd_out,
 		goto out;
 	}
 
-	ret = posix_memalign((void **)&buffer_in, pagesize, args->chunk_size);
-	if (ret != 0) {
-		ret = ENOMEM;
-		fprintf(stderr,
-		    "File %s: failed to allocate memory (%d bytes): %s\n",
-		    args->filename, args->chunk_size, strerror(ret));
+	args->window = 0;
+	in_size = args->chunk_size;
+	use_dict = (args->format & LZM_DICT) != 0;
+	args->format &= ~LZM_DICT;
+	if ((args->format & LZM_LINKED) != 0) {
+		args->format &= ~LZM_LINKED;
+
+		bytes = sizeof(args->window);
+		ret = read_data(fd_in, &args->window, &bytes);
+		if (ret != 0) {
+			fprintf(stderr, "File %s: failed to read data: %s\n",
+			    args->filename, strerror(ret));
+			goto out;
+		}
+
+		if (bytes != sizeof(args->window)) {
+			ret = EIO;
+			fprintf(stderr, "File %s: Unexpected eof\n",
+			    args->filename);
+			goto out;
+		}
+
+		total_in += bytes;
+		in_size = lzm_compressed_size(args->chunk_size);
+	}
+
+	if (use_dict) {
+		bytes = sizeof(dict_id);
+		ret = read_data(fd_in, &dict_id, &bytes);
+		if (ret != 0) {
+			fprintf(stderr, "File %s: failed to read data: %s\n",
+			    args->filename, strerror(ret));
+			goto out;
+		}
+
+		if (bytes != sizeof(dict_id)) {
+			ret = EIO;
+			fprintf(stderr, "File %s: Unexpected eof\n",
+			    args->filename);
+			goto out;
+		}
+
+		total_in += bytes;
+
+		if (args->dict == NULL) {
+			ret = EINVAL;
+			fprintf(stderr, "File %s: needs a dictionary (--dict)\n",
+			    args->filename);
+			goto out;
+		}
+
+		if (dict_id != lzm_dict_id(args->dict, args->dict_size)) {
+			ret = EINVAL;
+			fprintf(stderr, "File %s: wrong dictionary\n",
+			    args->filename);
+			goto out;
+		}
+	}
+
+	/*
+	 * Each chunk is read into the end of the buffer and decoded in place
+	 * to its start.
+	 */
+	buffer_size = args->chunk_size + lzm_decode_margin(in_size);
+	if (buffer_size < args->chunk_size) {
+		ret = EINVAL;
+		fprintf(stderr, "File %s: Invalid chunk size\n",
+		    args->filename);
 		goto out;
 	}
 
-	ret = posix_memalign((void **)&buffer_out, pagesize, args->chunk_size);
+	ret = posix_memalign((void **)&buffer, pagesize, buffer_size);
 	if (ret != 0) {
 		ret = ENOMEM;
 		fprintf(stderr,
-		    "File %s: failed to allocate memory (%d bytes): %s\n",
-		    args->filename, args->chunk_size, strerror(ret));
+		    "File %s: failed to allocate memory (%u bytes): %s\n",
+		    args->filename, buffer_size, strerror(ret));
 		goto out;
 	}
 
-	ret = lzm_decode_init(&state, args->format);
+	if (args->window != 0)
+		ret = lzm_decode_init_stream(&state, args->format,
+		    args->window);
+	else if (use_dict)
+		ret = lzm_decode_init_dict(&state, args->format, args->dict,
+		    args->dict_size);
+	else
+		ret = lzm_decode_init(&state, args->format);
+	if (ret == 0)
+		ret = lzm_decode_set_prefetch(state, args->prefetch);
 	if (ret != 0) {
 		fprintf(stderr, "File %s: failed to init lzm: %s\n",
 		    args->filename, strerror(ret));
@@ -366,19 +579,21 @@ decompress_fd(const int fd_in, const int fd_out,
 		total_in += bytes;
 
 		no_compression = 0;
-		if (args->chunk_size < LZM_NO_COMPRESSION &&
+		if (args->window == 0 &&
+		    args->chunk_size < LZM_NO_COMPRESSION &&
 		    (size_in & LZM_NO_COMPRESSION) != 0) {
 			no_compression = 1;
 			size_in &= ~LZM_NO_COMPRESSION;
 		}
 
-		if (size_in > args->chunk_size) {
+		if (size_in > in_size) {
 			ret = EINVAL;
 			fprintf(stderr, "File %s: Invalid chunk size\n",
 			    args->filename);
 			goto out;
 		}
 
+		buffer_in = buffer + buffer_size - size_in;
 		bytes = size_in;
 		ret = read_data(fd_in, buffer_in, &bytes);
 		if (ret != 0) {
@@ -396,16 +611,17 @@ decompress_fd(const int fd_in, const int fd_out,
 
 		size_out = args->chunk_size;
 		if (!no_compression) {
-			ret = lzm_decode(state, buffer_in, size_in,
-			    buffer_out, &size_out);
+			ret = lzm_decode_in_place(state, buffer, buffer_size,
+			    size_in, &size_out);
 			if (ret != 0) {
 				fprintf(stderr,
 				    "File %s: failed to decode data: %s\n",
 				    args->filename, strerror(ret));
 				goto out;
 			}
-			write_buffer = buffer_out;
+			write_buffer = buffer;
 		} else {
+			size_out = size_in;
 			write_buffer = buffer_in;
 		}
 
@@ -428,10 +644,8 @@ decompress_fd(const int fd_in, const int fd_out,
 
 	lzm_decode_finish(state);
 
-	if (buffer_in != NULL)
-		free(buffer_in);
-	if (buffer_out != NULL)
-		free(buffer_out);
+	if (buffer != NULL)
+		free(buffer);
 
 	if (args->verbose == true && ret == 0 && fd_out != STDOUT_FILENO) {
 		float perc = (float)total_out / (float)total_in * (float)100;
@@ -526,33 +740,32 @@ struct chunk {
 	unsigned int size_decomp_out;
 };
 
+/*
+ * Time decoding the chunks, checked with lzm_decode() or trusted with
+ * lzm_decode_trusted(), and return the best rate.
+ */
 static unsigned int
-benchmark_level(struct compress_args * const args, struct chunk *chunks,
-    unsigned int nchunks)
+benchmark_decode(struct compress_args * const args, struct chunk *chunks,
+    unsigned int nchunks, const unsigned int trusted,
+    double * const decomp_rate)
 {
 	struct lzm_state *state = NULL;
 	double rate;
-	double comp_rate;
-	double decomp_rate;
-	double comp_perc;
 	unsigned long ts_start;
 	unsigned long iterations;
 	unsigned long time;
 	unsigned int t;
 	unsigned int c;
 	unsigned int ret;
-	off_t comp_size;
-	off_t decomp_size;
-	off_t offset = 0;
-	const unsigned char *d1;
-	const unsigned char *d2;
 
-	comp_rate = 0;
-	ret = lzm_encode_init(&state, args->format, args->level);
+	*decomp_rate = 0;
+	ret = lzm_decode_init(&state, args->format);
+	if (ret == 0)
+		ret = lzm_decode_set_prefetch(state, args->prefetch);
 	if (ret != 0) {
 		fprintf(stderr, "File %s: failed to init lzm: %s\n",
 		    args->filename, strerror(ret));
-		goto out;
+		return ret;
 	}
 
 	for (t = 0; t < args->bench_tests; t++) {
@@ -563,13 +776,22 @@ benchmark_level(struct compress_args * const args, struct chunk *chunks,
 
 		do {
 			for (c = 0; c < nchunks; c++) {
-				chunks[c].size_comp_out = chunks[c].size_comp;
-				ret = lzm_encode(state, chunks[c].data_orig,
-				    chunks[c].size_orig, chunks[c].data_comp,
-				    &chunks[c].size_comp_out);
+				chunks[c].size_decomp_out = chunks[c].size_orig;
+				if (trusted)
+					ret = lzm_decode_trusted(state,
+					    chunks[c].data_comp,
+					    chunks[c].size_comp_out,
+					    chunks[c].data_decomp,
+					    &chunks[c].size_decomp_out);
+				else
+					ret = lzm_decode(state,
+					    chunks[c].data_comp,
+					    chunks[c].size_comp_out,
+					    chunks[c].data_decomp,
+					    &chunks[c].size_decomp_out);
 				if (unlikely(ret != 0)) {
 					fprintf(stderr,
-					"File %s: failed to encode data: %s\n",
+					"File %s: failed to decode data: %s\n",
 					    args->filename, strerror(ret));
 					goto out;
 				}
@@ -582,8 +804,8 @@ benchmark_level(struct compress_args * const args, struct chunk *chunks,
 
 		rate = (double)(args->st->st_size * iterations * 1000) /
 		    (double)time;
-		if (rate > comp_rate)
-			comp_rate = rate;
+		if (rate > *decomp_rate)
+			*decomp_rate = rate;
 
 		if (args->verbose == true) {
 			printf("%10.4f ", rate);
@@ -594,16 +816,37 @@ benchmark_level(struct compress_args * const args, struct chunk *chunks,
 	if (args->verbose == true)
 		printf("\n");
 
-	lzm_encode_finish(state);
-
-	comp_size = 0;
-	for (c = 0; c < nchunks; c++)
-		comp_size += chunks[c].size_comp_out;
+ out:
+	lzm_decode_finish(state);
+	return ret;
+}
 
-	comp_perc = (double)(comp_size * 100) / (double)args->st->st_size;
+static unsigned int
+benchmark_level(struct compress_args * const args, struct chunk *chunks,
+    unsigned int nchunks)
+{
+	struct lzm_state *state = NULL;
+	double rate;
+	double comp_rate;
+	double decomp_rate;
+	double trusted_rate;
+	double comp_perc;
+	unsigned long ts_start;
+	unsigned long iterations;
+	unsigned long time;
+	unsigned int t;
+	unsigned int c;
+	unsigned int ret;
+	off_t comp_size;
+	off_t decomp_size;
+	off_t offset = 0;
+	const unsigned char *d1;
+	const unsigned char *d2;
 
-	decomp_rate = 0;
-	ret = lzm_decode_init(&state, args->format);
+	comp_rate = 0;
+	ret = lzm_encode_init(&state, args->format, args->level);
+	if (ret == 0)
+		ret = lzm_encode_set_sample(state, args->sample);
 	if (ret != 0) {
 		fprintf(stderr, "File %s: failed to init lzm: %s\n",
 		    args->filename, strerror(ret));
@@ -618,14 +861,13 @@ benchmark_level(struct compress_args * const args, struct chunk *chunks,
 
 		do {
 			for (c = 0; c < nchunks; c++) {
-				chunks[c].size_decomp_out = chunks[c].size_orig;
-				ret = lzm_decode(state, chunks[c].data_comp,
-				    chunks[c].size_comp_out,
-				    chunks[c].data_decomp,
-				    &chunks[c].size_decomp_out);
+				chunks[c].size_comp_out = chunks[c].size_comp;
+				ret = lzm_encode(state, chunks[c].data_orig,
+				    chunks[c].size_orig, chunks[c].data_comp,
+				    &chunks[c].size_comp_out);
 				if (unlikely(ret != 0)) {
 					fprintf(stderr,
-					"File %s: failed to decode data: %s\n",
+					"File %s: failed to encode data: %s\n",
 					    args->filename, strerror(ret));
 					goto out;
 				}
@@ -638,8 +880,8 @@ benchmark_level(struct compress_args * const args, struct chunk *chunks,
 
 		rate = (double)(args->st->st_size * iterations * 1000) /
 		    (double)time;
-		if (rate > decomp_rate)
-			decomp_rate = rate;
+		if (rate > comp_rate)
+			comp_rate = rate;
 
 		if (args->verbose == true) {
 			printf("%10.4f ", rate);
@@ -650,7 +892,20 @@ benchmark_level(struct compress_args * const args, struct chunk *chunks,
 	if (args->verbose == true)
 		printf("\n");
 
-	lzm_decode_finish(state);
+	lzm_encode_finish(state);
+
+	comp_size = 0;
+	for (c = 0; c < nchunks; c++)
+		comp_size += chunks[c].size_comp_out;
+
+	comp_perc = (double)(comp_size * 100) / (double)args->st->st_size;
+
+	ret = benchmark_decode(args, chunks, nchunks, false, &decomp_rate);
+	if (ret == 0)
+		ret = benchmark_decode(args, chunks, nchunks, true,
+		    &trusted_rate);
+	if (ret != 0)
+		goto out;
 
 	decomp_size = 0;
 	for (c = 0; c < nchunks; c++) {
@@ -683,8 +938,9 @@ benchmark_level(struct compress_args * const args, struct chunk *chunks,
 		    args->filename, args->st->st_size, decomp_size);
 	}
 
-	printf("Level %d: --> %lu, %9.4f%%, %10.4f MB/s, %10.4f MB/s\n",
-	    args->level, comp_size, comp_perc, comp_rate, decomp_rate);
+	printf("Level %d: --> %lu, %9.4f%%, %10.4f MB/s, %10.4f MB/s, "
+	    "%10.4f MB/s\n", args->level, comp_size, comp_perc, comp_rate,
+	    decomp_rate, trusted_rate);
 
  out:
 	return ret;
@@ -707,7 +963,7 @@ benchmark_init_chunk(const int fd_in, struct chunk * const chunk,
 	}
 
 	ret = posix_memalign((void **)&chunk->data_decomp, pagesize,
-	    chunk->size_orig);
+	    chunk->size_orig + LZM_DECODE_MARGIN);
 	if (ret != 0) {
 		ret = ENOMEM;
 		fprintf(stderr, "File %s: failed to allocate %d bytes: %s\n",
@@ -715,7 +971,7 @@ benchmark_init_chunk(const int fd_in, struct chunk * const chunk,
 		goto out;
 	}
 
-	chunk->size_comp = lzm_compressed_size(chunk->size_orig);
+	chunk->size_comp = lzm_encode_bound(chunk->size_orig);
 	ret = posix_memalign((void **)&chunk->data_comp, pagesize,
 	    chunk->size_comp);
 	if (ret != 0) {
@@ -793,6 +1049,11 @@ benchmark(const int fd_in, struct compress_args * const args)
 	}
 
 	printf("File %s: size %lu bytes\n", args->filename, args->st->st_size);
+	if (args->verbose == true)
+		printf("Caches: L1 %uKB, L2 %uKB, L3 %uKB\n",
+		    lzm_cache_size(LZM_CACHE_L1) >> 10,
+		    lzm_cache_size(LZM_CACHE_L2) >> 10,
+		    lzm_cache_size(LZM_CACHE_L3) >> 10);
 
 	if (args->level != LZM_LEVEL_DEF)
 		benchmark_level(args, chunks, nchunks);
@@ -1074,6 +1335,149 @@ process_path(struct compress_args * const args)
 	return ret;
 }
 
+static unsigned int
+read_file(const char * const filename, unsigned char ** const buffer,
+    unsigned int * const size, const unsigned int max)
+{
+	struct stat st;
+	unsigned int bytes;
+	int fd;
+	int ret;
+
+	*buffer = NULL;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		ret = errno;
+		fprintf(stderr, "File %s: failed to open file: %s\n",
+		    filename, strerror(ret));
+		return ret;
+	}
+
+	ret = fstat(fd, &st);
+	if (ret < 0) {
+		ret = errno;
+		fprintf(stderr, "File %s: cannot stat: %s\n",
+		    filename, strerror(ret));
+		goto out;
+	}
+
+	if (!S_ISREG(st.st_mode) || st.st_size == 0 || st.st_size > max) {
+		ret = EINVAL;
+		fprintf(stderr, "File %s: not a regular file of 1 to %u bytes\n",
+		    filename, max);
+		goto out;
+	}
+
+	*size = st.st_size;
+	*buffer = malloc(*size);
+	if (*buffer == NULL) {
+		ret = ENOMEM;
+		fprintf(stderr, "File %s: failed to allocate %d bytes: %s\n",
+		    filename, *size, strerror(ret));
+		goto out;
+	}
+
+	bytes = *size;
+	ret = read_data(fd, *buffer, &bytes);
+	if (ret == 0 && bytes != *size)
+		ret = EIO;
+	if (ret != 0) {
+		fprintf(stderr, "File %s: failed to read data: %s\n",
+		    filename, strerror(ret));
+		free(*buffer);
+		*buffer = NULL;
+	}
+
+ out:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Train a dictionary from every file named, each one is a sample.
+ */
+static unsigned int
+train_dict(struct compress_args * const args, char ** const files,
+    const unsigned int nfiles)
+{
+	unsigned char *samples = NULL;
+	unsigned char *sample;
+	unsigned char *dict = NULL;
+	unsigned int *sizes = NULL;
+	unsigned int total = 0;
+	unsigned int dict_size;
+	unsigned int i;
+	int fd = -1;
+	int ret;
+
+	sizes = malloc(nfiles * sizeof(*sizes));
+	dict = malloc(args->train_size);
+	if (sizes == NULL || dict == NULL) {
+		ret = ENOMEM;
+		fprintf(stderr, "Failed to allocate memory: %s\n",
+		    strerror(ret));
+		goto out;
+	}
+
+	for (i = 0; i < nfiles; i++) {
+		ret = read_file(files[i], &sample, &sizes[i],
+		    LZM_WINDOW_MAX - total);
+		if (ret != 0)
+			goto out;
+
+		samples = realloc(samples, total + sizes[i]);
+		if (samples == NULL) {
+			ret = ENOMEM;
+			fprintf(stderr, "Failed to allocate memory: %s\n",
+			    strerror(ret));
+			free(sample);
+			goto out;
+		}
+
+		memcpy(samples + total, sample, sizes[i]);
+		total += sizes[i];
+		free(sample);
+	}
+
+	dict_size = args->train_size;
+	ret = lzm_train_dict(samples, sizes, nfiles, dict, &dict_size);
+	if (ret != 0) {
+		fprintf(stderr, "Failed to train dictionary: %s\n",
+		    strerror(ret));
+		goto out;
+	}
+
+	fd = open(args->train, O_WRONLY | O_CREAT |
+	    (args->clobber == true ? O_TRUNC : O_EXCL), 0600);
+	if (fd < 0) {
+		ret = errno;
+		fprintf(stderr, "File %s: failed to open file: %s\n",
+		    args->train, strerror(ret));
+		goto out;
+	}
+
+	ret = write_data(fd, dict, dict_size);
+	if (ret != 0) {
+		fprintf(stderr, "File %s: failed to write data: %s\n",
+		    args->train, strerror(ret));
+		goto out;
+	}
+
+	if (args->verbose == true)
+		printf("Trained %s: %u samples, in %u, dictionary %u\n",
+		    args->train, nfiles, total, dict_size);
+
+ out:
+	if (fd >= 0)
+		close(fd);
+	free(samples);
+	free(sizes);
+	free(dict);
+
+	return ret;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -1093,9 +1497,18 @@ main(int argc, char **argv)
 	args.verbose = false;
 	args.test = false;
 	args.chunk_size = CHUNK_SIZE;
+	args.window = 0;
+	args.ldm = false;
+	args.sample = LZM_SAMPLE_DEF;
+	args.prefetch = false;
+	args.dict = NULL;
+	args.dict_size = 0;
+	args.train_size = DICT_SIZE;
+	args.train = NULL;
 	args.bench_tests = BENCH_TESTS;
 
-	while ((c = getopt(argc, argv, "01234567b:cdfhkrtvx:")) != EOF) {
+	while ((c = getopt_long(argc, argv, "0123456789b:cdfhkrtvw:x:",
+	    long_opts, NULL)) != EOF) {
 		switch (c) {
 		case '0':
 		case '1':
@@ -1105,8 +1518,76 @@ main(int argc, char **argv)
 		case '5':
 		case '6':
 		case '7':
+		case '8':
+		case '9':
 			args.level = c - '0';
 			break;
+		case LEVEL:
+			args.level = strtoul(optarg, NULL, 0);
+			if (args.level >= LZM_LEVEL_COUNT) {
+				printf("Level must be less than %d.\n",
+				    LZM_LEVEL_COUNT);
+				exit(1);
+			}
+			break;
+		case FAST:
+			args.level = strtoul(optarg, NULL, 0);
+			if (args.level == 0 || args.level > LZM_ACCEL_COUNT) {
+				printf("Fast level must be 1 to %d.\n",
+				    LZM_ACCEL_COUNT);
+				exit(1);
+			}
+			args.level += LZM_LEVEL_ACCEL - 1;
+			break;
+		case FORMAT:
+			args.format = strtoul(optarg, NULL, 0);
+			if (args.format != LZM_FORMAT_1 &&
+			    args.format != LZM_FORMAT_2) {
+				printf("Format must be %d or %d.\n",
+				    LZM_FORMAT_1, LZM_FORMAT_2);
+				exit(1);
+			}
+			break;
+		case DICTIONARY:
+			free(args.dict);
+			ret = read_file(optarg, &args.dict, &args.dict_size,
+			    LZM_WINDOW_MAX);
+			if (ret != 0)
+				exit(1);
+			break;
+		case DICTIONARY_SIZE:
+			args.train_size = strtoul(optarg, NULL, 0);
+			if (args.train_size == 0 ||
+			    args.train_size > (LZM_WINDOW_MAX >> 10)) {
+				printf("Dictionary size must be 1 to %d KB.\n",
+				    LZM_WINDOW_MAX >> 10);
+				exit(1);
+			}
+			args.train_size <<= 10;
+			break;
+		case TRAIN:
+			args.train = optarg;
+			break;
+		case LONG:
+			args.ldm = true;
+			break;
+		case CACHE:
+			ret = set_cache_sizes(optarg);
+			if (ret != 0) {
+				printf("Cache sizes must be <l1>,<l2>,<l3> in KB.\n");
+				exit(1);
+			}
+			break;
+		case SAMPLE:
+			args.sample = strtoul(optarg, NULL, 0);
+			if (args.sample > 100) {
+				printf("Sample threshold must be 0 to 100.\n");
+				exit(1);
+			}
+			break;
+		case PREFETCH:
+			args.prefetch = true;
+			break;
 		case 'b':
 			args.benchmark = true;
 			args.bench_tests = strtoul(optarg, NULL, 0);
@@ -1136,6 +1617,16 @@ main(int argc, char **argv)
 		case 'v':
 			args.verbose = true;
 			break;
+		case 'w':
+			args.window = strtoul(optarg, NULL, 0);
+			if (args.window == 0 ||
+			    args.window > (LZM_WINDOW_MAX >> 20)) {
+				printf("Window must be 1 to %d MB.\n",
+				    LZM_WINDOW_MAX >> 20);
+				exit(1);
+			}
+			args.window <<= 20;
+			break;
 		case 'x':
 			args.chunk_size = strtoul(optarg, NULL, 0);
 			if (args.chunk_size >= (1 << 22)) {
@@ -1161,6 +1652,22 @@ main(int argc, char **argv)
 		exit(1);
 	}
 
+	/* Long matches are searched for over the largest window by default */
+	if (args.ldm == true && args.window == 0)
+		args.window = LZM_WINDOW_MAX;
+
+	if (args.dict != NULL && args.window != 0) {
+		printf("A dictionary can not be used with linked chunks.\n");
+		free(args.dict);
+		exit(1);
+	}
+
+	if (args.train != NULL) {
+		ret = train_dict(&args, argv + optind, argc - optind);
+		free(args.dict);
+		return ret;
+	}
+
 	while (optind < argc) {
 		args.filename = argv[optind];
 		err = process_path(&args);
@@ -1169,5 +1676,6 @@ main(int argc, char **argv)
 		optind++;
 	}
 
+	free(args.dict);
 	return ret;
 }
@@ -13,24 +13,75 @@ extern "C" {
 #define LZM_LEVEL_5	5
 #define LZM_LEVEL_6	6
 #define LZM_LEVEL_7	7
-#define LZM_LEVEL_COUNT	8
+#define LZM_LEVEL_8	8
+#define LZM_LEVEL_9	9
+#define LZM_LEVEL_10	10
+#define LZM_LEVEL_11	11
+#define LZM_LEVEL_12	12
+#define LZM_LEVEL_13	13
+#define LZM_LEVEL_14	14
+#define LZM_LEVEL_15	15
+#define LZM_LEVEL_16	16
+#define LZM_LEVEL_17	17
+#define LZM_LEVEL_18	18
+#define LZM_LEVEL_19	19
+#define LZM_LEVEL_COUNT	20
 
 #define LZM_LEVEL_DEF	0xFFFFFFFF
 #define LZM_LEVEL_NONE	LZM_LEVEL_0
 #define LZM_LEVEL_FAST	LZM_LEVEL_1
+#define LZM_LEVEL_ACCEL	LZM_LEVEL_15	/* --fast=1, up to LZM_LEVEL_18 */
+#define LZM_ACCEL_COUNT	4
 
 #define LZM_FORMAT_1	1
+#define LZM_FORMAT_2	2	/* adds repeat offset codes */
+
+#define LZM_WINDOW_MAX	(256 << 20)
+
+#define LZM_SAMPLE_DEF	1	/* percent, see lzm_encode_set_sample() */
+
+#define LZM_DECODE_MARGIN 32	/* output slack for lzm_decode_trusted() */
+
+#define LZM_CACHE_L1	1
+#define LZM_CACHE_L2	2
+#define LZM_CACHE_L3	3
+#define LZM_CACHE_COUNT	4
 
 struct lzm_state;
 
 unsigned int lzm_compressed_size(
     const unsigned int);
 
+unsigned int lzm_encode_bound(
+    const unsigned int);
+
+unsigned int lzm_decode_margin(
+    const unsigned int);
+
 unsigned int lzm_encode_init(
     struct lzm_state ** const state,
     const unsigned int format,
     const unsigned int level);
 
+unsigned int lzm_encode_init_stream(
+    struct lzm_state ** const state,
+    const unsigned int format,
+    const unsigned int level,
+    const unsigned int window);
+
+unsigned int lzm_encode_init_long(
+    struct lzm_state ** const state,
+    const unsigned int format,
+    const unsigned int level,
+    const unsigned int window);
+
+unsigned int lzm_encode_init_dict(
+    struct lzm_state ** const state,
+    const unsigned int format,
+    const unsigned int level,
+    const unsigned char * const dict,
+    const unsigned int dict_size);
+
 unsigned int lzm_encode(
     const struct lzm_state * const state,
     const unsigned char * const buffer_in,
@@ -41,10 +92,37 @@ unsigned int lzm_encode(
 unsigned int lzm_encode_finish(
     const struct lzm_state * const state);
 
+unsigned int lzm_encode_set_sample(
+    struct lzm_state * const state,
+    const unsigned int percent);
+
+unsigned int lzm_encode_orders(
+    const struct lzm_state * const state,
+    unsigned int * const hash_order,
+    unsigned int * const chain_order);
+
+unsigned int lzm_cache_size(
+    const unsigned int cache);
+
+unsigned int lzm_set_cache_size(
+    const unsigned int cache,
+    const unsigned int size);
+
 unsigned int lzm_decode_init(
     struct lzm_state ** const state,
     const unsigned int format);
 
+unsigned int lzm_decode_init_stream(
+    struct lzm_state ** const state,
+    const unsigned int format,
+    const unsigned int window);
+
+unsigned int lzm_decode_init_dict(
+    struct lzm_state ** const state,
+    const unsigned int format,
+    const unsigned char * const dict,
+    const unsigned int dict_size);
+
 unsigned int lzm_decode(
     const struct lzm_state * const state,
     const unsigned char * const buffer_in,
@@ -52,9 +130,38 @@ unsigned int lzm_decode(
     unsigned char * const buffer_out,
     unsigned int * const size_out);
 
+unsigned int lzm_decode_in_place(
+    const struct lzm_state * const state,
+    unsigned char * const buffer,
+    const unsigned int buffer_size,
+    const unsigned int size_in,
+    unsigned int * const size_out);
+
+unsigned int lzm_decode_set_prefetch(
+    struct lzm_state * const state,
+    const unsigned int enable);
+
+unsigned int lzm_decode_trusted(
+    const struct lzm_state * const state,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out);
+
 unsigned int lzm_decode_finish(
     const struct lzm_state * const state);
 
+unsigned int lzm_dict_id(
+    const unsigned char * const dict,
+    const unsigned int dict_size);
+
+unsigned int lzm_train_dict(
+    const unsigned char * const samples,
+    const unsigned int * const sizes,
+    const unsigned int count,
+    unsigned char * const dict,
+    unsigned int * const dict_size);
+
 #ifdef __cplusplus
 }
 #endif
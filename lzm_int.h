@@ -1,21 +1,111 @@
 #define HASH_ORDER_FAST		12
+#define HASH_ORDER_ACCEL	11
+#define HASH_ORDER_LAZY		14
 #define HASH_ORDER_MID		16
 #define HASH_ORDER_HIGH		20
+#define HASH_ORDER_BUCKET	17
+#define BUCKET_ORDER		3
+#define BUCKET_WAYS		(1 << BUCKET_ORDER)
 #define MAX_CHAIN_LENGTH	128
+#define BT_DEPTH		16
+#define BT_NICE			64
+#define OPT_NUM			4096
+#define OPT_NICE		256
+#define OPT_COST_SHIFT		4
+#define DEC_COST_TOKEN		32
+#define DEC_COST_LITERAL	64
+#define DEC_COST_OVERLAP	64
+#define DEC_COST_OVERLAP_BYTE	8
+#define DEC_COST_LONG		32
 #define MIN_MATCH		4
 #define MISS_ORDER		6
+#define PREFETCH_DIST		8
+#define PATTERN_BYTES		16
+#define RUN_MIN			32
+#define RUN_PERIOD		8
+#define SAMPLE_MIN_INPUT	(16 << 10)
+#define SAMPLE_SPANS		32
+#define SAMPLE_SPAN		256
+#define SAMPLE_ORDER		11
+#define DECODE_BATCH		16
+#define DECODE_BATCH_MIN	(8 << 20)
+#define NT_OUTPUT_SCALE		4
+#define NT_RUN_MIN		(4 << 10)
+#define NT_KEEP			(1 << 10)
+#define RESET_ORDER		5
 #define MAX_OFFSET_ORDER	28
 #define MAX_OFFSET		(1 << MAX_OFFSET_ORDER)
 #define MAX_OFFSET_MASK		(MAX_OFFSET - 1)
+#define REP_COUNT		3
+#define REP_INIT		{ 1, 4, 8 }
 #define MEM_ALIGN		64
+#define STREAM_MAX_INPUT	(1U << 30)
+#define STREAM_MAX_POS		(1U << 31)
+#define DICT_SEGMENT		64
+#define LDM_MIN_MATCH		64
+#define LDM_HASH_ORDER		22
+#define LDM_SAMPLE_ORDER	6
+#define DICT_TRAIN_LEVEL	LZM_LEVEL_5
+#define CACHE_REF_L1		(32 << 10)
+#define CACHE_REF_L2		(256 << 10)
+#define CACHE_REF_L3		(8 << 20)
+#define CACHE_GROW_MAX		1
+#define CACHE_SHRINK_MAX	2
+#define CACHE_INDEX_MAX		16
+#define CACHE_SYSFS		"/sys/devices/system/cpu/cpu0/cache"
+
+/*
+ * History kept between calls in stream mode.  The buffer holds up to history
+ * bytes of earlier data followed by the data of the current call, so matches
+ * can reach back across calls.  pos is the table index of buf[0].  Without
+ * linked the history is a fixed dictionary that every call starts from.
+ */
+struct lzm_window {
+	unsigned char *buf;
+	unsigned int size;
+	unsigned int used;
+	unsigned int history;
+	unsigned int pos;
+	unsigned int reset;
+	unsigned int linked;
+};
 
 struct lzm_state {
 	struct ht_entry *last_ht;
-	struct ht_entry *chains;
+	union {
+		unsigned int *chains;	/* previous index with the same hash */
+		struct bt_node *tree;
+	};
+	struct lzm_opt *opt;
+	struct lzm_window *window;
+	struct lzm_dict *dict;
+	struct lzm_epoch *epoch;
+	struct lzm_ldm *ldm;
 	unsigned int hash_order;
 	unsigned int hash_buckets;
 	unsigned int chain_order;
 	unsigned int chain_mask;
+	unsigned int chain_length;
+	unsigned int prefetch;	/* hash table larger than the L2 */
+	unsigned int sample;	/* store below this % of repeats */
+	unsigned int batch;	/* see lzm_decode_set_prefetch() */
 	unsigned int level;
 	unsigned int format;
 };
+
+int lzm_window_init(
+    struct lzm_window ** const,
+    const unsigned int);
+
+int lzm_window_dict(
+    struct lzm_window ** const,
+    const unsigned char * const,
+    const unsigned int);
+
+int lzm_window_reserve(
+    struct lzm_window * const,
+    const unsigned int,
+    unsigned int * const);
+
+void lzm_window_finish(
+    struct lzm_window * const);
@@ -4,6 +4,9 @@
 #include <sys/errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,6 +19,141 @@
 __attribute__((aligned(64)))
 const unsigned int mask[5] = { 0, 0xFF, 0xFFFF, 0xFFFFFF, 0xFFFFFFFF };
 
+#if defined(__SSSE3__)
+/*
+ * Shuffles repeating the first off bytes of a vector, for matches closer than
+ * PATTERN_BYTES.  The second half continues where the first leaves off.
+ */
+#define PATTERN(n) { \
+	0 % (n), 1 % (n), 2 % (n), 3 % (n), 4 % (n), 5 % (n), 6 % (n), \
+	7 % (n), 8 % (n), 9 % (n), 10 % (n), 11 % (n), 12 % (n), 13 % (n), \
+	14 % (n), 15 % (n), 16 % (n), 17 % (n), 18 % (n), 19 % (n), \
+	20 % (n), 21 % (n), 22 % (n), 23 % (n), 24 % (n), 25 % (n), \
+	26 % (n), 27 % (n), 28 % (n), 29 % (n), 30 % (n), 31 % (n) }
+
+__attribute__((aligned(64)))
+static const unsigned char pattern_index[PATTERN_BYTES][32] = {
+	{ 0 },		PATTERN(1),	PATTERN(2),	PATTERN(3),
+	PATTERN(4),	PATTERN(5),	PATTERN(6),	PATTERN(7),
+	PATTERN(8),	PATTERN(9),	PATTERN(10),	PATTERN(11),
+	PATTERN(12),	PATTERN(13),	PATTERN(14),	PATTERN(15),
+};
+
+#if defined(__AVX2__)
+#define PATTERN_STORE	32
+#else
+#define PATTERN_STORE	16
+#endif
+#define STEP(n)		(PATTERN_STORE - PATTERN_STORE % (n))
+
+/* The whole patterns in a store */
+static const unsigned char pattern_step[PATTERN_BYTES] = {
+	0,		STEP(1),	STEP(2),	STEP(3),
+	STEP(4),	STEP(5),	STEP(6),	STEP(7),
+	STEP(8),	STEP(9),	STEP(10),	STEP(11),
+	STEP(12),	STEP(13),	STEP(14),	STEP(15),
+};
+
+/*
+ * Expand the off byte pattern before out to at least length bytes, a store
+ * at a time.  Each store starts the pattern afresh, so the next one is a
+ * whole number of patterns on.  Writes up to PATTERN_STORE - 1 bytes past
+ * the end.
+ */
+static inline unsigned char *
+copy_pattern(unsigned char *out, const unsigned int off,
+    const unsigned int length)
+{
+	unsigned char * const end = out + length;
+	const unsigned int step = pattern_step[off];
+	const __m128i src = _mm_loadu_si128((const __m128i *)(out - off));
+	const __m128i lo = _mm_shuffle_epi8(src,
+	    _mm_load_si128((const __m128i *)pattern_index[off]));
+#if defined(__AVX2__)
+	const __m128i hi = _mm_shuffle_epi8(src,
+	    _mm_load_si128((const __m128i *)(pattern_index[off] + 16)));
+	const __m256i pattern = _mm256_set_m128i(hi, lo);
+
+	do {
+		_mm256_storeu_si256((__m256i *)out, pattern);
+		out += step;
+	} while (out < end);
+#else
+	do {
+		_mm_storeu_si128((__m128i *)out, lo);
+		out += step;
+	} while (out < end);
+#endif
+
+	return end;
+}
+#endif
+
+/*
+ * Copy with non-temporal stores, which go to memory without displacing the
+ * cache, for output that will not be read back soon.  As with memmove(),
+ * in may lie just above out, each block is read before it is overwritten.
+ */
+static inline void
+copy_nt(unsigned char *out, const unsigned char *in,
+    const unsigned int length)
+{
+#if defined(__SSE2__)
+	unsigned char * const end = out + length;
+	const unsigned int head = -(unsigned long)out & 15;
+
+	if (length < head + 64) {
+		memmove(out, in, length);
+		return;
+	}
+
+	memmove(out, in, head);
+	out += head;
+	in += head;
+	while (out + 16 <= end) {
+		_mm_stream_si128((__m128i *)out,
+		    _mm_loadu_si128((const __m128i *)in));
+		out += 16;
+		in += 16;
+	}
+	memmove(out, in, end - out);
+	_mm_sfence();
+#else
+	memmove(out, in, length);
+#endif
+}
+
+/*
+ * Literal runs of NT_RUN_MIN or more bypass the cache when nt is set, but
+ * for the last NT_KEEP bytes where the next matches are most likely to
+ * look.  Decoding in place the input may be closer than length ahead of
+ * out, see lzm_decode_margin(), so every run is moved.
+ */
+static inline void
+copy_literals(unsigned char * const out, const unsigned char * const in,
+    const unsigned int length, const unsigned int nt)
+{
+	if (unlikely(nt && length >= NT_RUN_MIN)) {
+		copy_nt(out, in, length - NT_KEEP);
+		memmove(out + length - NT_KEEP, in + length - NT_KEEP,
+		    NT_KEEP);
+		return;
+	}
+
+	memmove(out, in, length);
+}
+
+/*
+ * Whether an output of size bytes is large enough, NT_OUTPUT_SCALE times the
+ * L3, that writing it through the cache would only evict the history that
+ * matches read and the data of everything else running.
+ */
+static inline unsigned int
+decode_nt(const unsigned int size)
+{
+	return size / NT_OUTPUT_SCALE > lzm_cache_size(LZM_CACHE_L3);
+}
+
 static inline const unsigned char *
 decode_offset(const unsigned char * const in, unsigned int * const length)
 {
@@ -53,29 +191,277 @@ decode_length(const unsigned char *in, unsigned int * const length)
 	return in;
 }
 
+/*
+ * Map a format 2 offset code back to an offset, mirroring rep_encode().
+ */
+static inline unsigned int
+rep_decode(unsigned int * const rep, const unsigned int code)
+{
+	unsigned int offset;
+	unsigned int i;
+
+	if (likely(code > REP_COUNT)) {
+		offset = code - REP_COUNT;
+		i = REP_COUNT - 1;
+	} else {
+		i = code - 1;
+		offset = rep[i];
+	}
+
+	for (; i > 0; i--)
+		rep[i] = rep[i - 1];
+	rep[0] = offset;
+
+	return offset;
+}
+
+/*
+ * Bytes by which a buffer decoded in place must exceed the decompressed
+ * size, for size_in bytes of compressed data placed at its end.  The output
+ * gains on the input only where a token is larger than the data it stands
+ * for, by at most one byte in five (an op byte and four offset bytes for a
+ * four byte match), plus the last literals and the bytes the wide copies
+ * write ahead.
+ */
+unsigned int
+lzm_decode_margin(const unsigned int size_in)
+{
+	return size_in / 5 + 8 + LZM_DECODE_MARGIN;
+}
+
 unsigned int
 lzm_decode_init(struct lzm_state ** const state, const unsigned int format)
 {
+	struct lzm_state *statep;
+
 	*state = NULL;
-	(void)format;
+
+	if (format != LZM_FORMAT_1 && format != LZM_FORMAT_2)
+		return EINVAL;
+
+	statep = calloc(1, sizeof(*statep));
+	if (statep == NULL)
+		return ENOMEM;
+
+	statep->format = format;
+	*state = statep;
+
 	return 0;
 }
 
+/*
+ * Decoder for streams written by a state from lzm_encode_init_stream() with
+ * the same window.
+ */
 unsigned int
-lzm_decode_finish(const struct lzm_state * const state)
+lzm_decode_init_stream(struct lzm_state ** const state,
+    const unsigned int format, const unsigned int window)
 {
-	(void)state;
+	int error;
+
+	error = lzm_decode_init(state, format);
+	if (error != 0)
+		return error;
+
+	error = lzm_window_init(&(*state)->window, window);
+	if (error != 0) {
+		lzm_decode_finish(*state);
+		*state = NULL;
+		return error;
+	}
+
+	(*state)->window->linked = true;
 	return 0;
 }
 
+/*
+ * Decoder for data written by a state from lzm_encode_init_dict() with the
+ * same dictionary.
+ */
 unsigned int
-lzm_decode(
-    const struct lzm_state * const state,
+lzm_decode_init_dict(struct lzm_state ** const state,
+    const unsigned int format, const unsigned char * const dict,
+    const unsigned int dict_size)
+{
+	int error;
+
+	error = lzm_decode_init(state, format);
+	if (error != 0)
+		return error;
+
+	error = lzm_window_dict(&(*state)->window, dict, dict_size);
+	if (error != 0) {
+		lzm_decode_finish(*state);
+		*state = NULL;
+	}
+
+	return error;
+}
+
+/*
+ * Decode in two passes over batches of sequences, prefetching each match
+ * before it is copied, when matches can reach more than DECODE_BATCH_MIN
+ * back.  This pays off only when most matches miss the caches, e.g. short
+ * repeats scattered over a large window, and costs a third of the speed
+ * otherwise, so it is off by default.  lzm_decode_trusted() ignores it.
+ */
+unsigned int
+lzm_decode_set_prefetch(struct lzm_state * const state,
+    const unsigned int enable)
+{
+	if (state == NULL)
+		return EINVAL;
+
+	state->batch = enable;
+
+	return 0;
+}
+
+unsigned int
+lzm_decode_finish(const struct lzm_state * const state)
+{
+	if (state != NULL) {
+		lzm_window_finish(state->window);
+		free((void *)state);
+	}
+
+	return 0;
+}
+
+/*
+ * Copy a match of mlen bytes from off back, overlapping its own output when
+ * off is less than mlen.  Room for the wide copies is checked unless trusted.
+ */
+static inline __attribute__((always_inline)) unsigned char *
+decode_match(unsigned char *curr_out, const unsigned int off,
+    const unsigned int mlen, const unsigned char * const out_limit,
+    const unsigned int trusted)
+{
+	const unsigned char *match;
+	unsigned char *mend;
+	unsigned long int c;
+
+	match = curr_out - off;
+	mend = curr_out + mlen;
+
+	if (likely(mlen <= off)) {
+		memcpy(curr_out, match, mlen);
+		curr_out += mlen;
+		return curr_out;
+	}
+
+#if defined(__SSSE3__)
+	if (likely(off < PATTERN_BYTES &&
+	    (trusted || mend + PATTERN_STORE <= out_limit))) {
+		return copy_pattern(curr_out, off, mlen);
+	}
+#endif
+
+	if (off == 1) {
+		c = *match;
+		*curr_out++ = c;
+		*curr_out++ = c;
+		*curr_out++ = c;
+		*curr_out++ = c;
+		while (curr_out < mend)
+			*curr_out++ = c;
+		return curr_out;
+	}
+
+	if (off == 2) {
+		c = readmem16(match);
+		writemem16(curr_out, c);
+		curr_out += 2;
+		writemem16(curr_out, c);
+		curr_out += 2;
+		while (curr_out < mend) {
+			writemem16(curr_out, c);
+			curr_out += 2;
+			writemem16(curr_out, c);
+			curr_out += 2;
+		}
+		curr_out = mend;
+		return curr_out;
+	}
+
+	if (off == 3) {
+		unsigned char c1, c2, c3;
+		c1 = *match;
+		c2 = *(match+1);
+		c3 = *(match+2);
+		*curr_out++ = c1;
+		*curr_out++ = c2;
+		*curr_out++ = c3;
+		*curr_out++ = c1;
+		*curr_out++ = c2;
+		*curr_out++ = c3;
+		while (curr_out < mend) {
+			*curr_out++ = c1;
+			*curr_out++ = c2;
+			*curr_out++ = c3;
+		}
+		curr_out = mend;
+		return curr_out;
+	}
+
+	if (off == 4) {
+		c = readmem32(match);
+		writemem32(curr_out, c);
+		curr_out += off;
+		writemem32(curr_out, c);
+		curr_out += off;
+		while (curr_out < mend) {
+			writemem32(curr_out, c);
+			curr_out += off;
+			writemem32(curr_out, c);
+			curr_out += off;
+		}
+		curr_out = mend;
+		return curr_out;
+	}
+
+	if (off <= 8) {
+		c = readmem64(match);
+		writemem64(curr_out, c);
+		curr_out += off;
+		while (curr_out < mend) {
+			writemem64(curr_out, c);
+			curr_out += off;
+		}
+		curr_out = mend;
+		return curr_out;
+	}
+
+	memcpy(curr_out, match, 4);
+	match += 4;
+	curr_out += 4;
+	while (curr_out < mend) {
+		memcpy(curr_out, match, 8);
+		match += 8;
+		curr_out += 8;
+	}
+	return mend;
+}
+
+/*
+ * Always inlined so each format gets its own copy of the loop and format 1
+ * pays nothing for the repeat offsets.  Matches may reach prefix bytes back
+ * before buffer_out.  A trusted copy skips every check on the input and the
+ * output space, see lzm_decode_trusted().  nt streams long literal runs
+ * past the cache.
+ */
+static inline __attribute__((always_inline)) unsigned int
+lzm_decode_format(
     const unsigned char * const buffer_in,
     const unsigned int size_in,
     unsigned char * const buffer_out,
-    unsigned int * const size_out)
+    unsigned int * const size_out,
+    const unsigned int prefix,
+    const unsigned int format,
+    const unsigned int trusted,
+    const unsigned int nt)
 {
+	const unsigned char * const low = buffer_out - prefix;
 	const unsigned char * const end = buffer_in + size_in;
 	const unsigned char * const match_end = end - 5;
 	const unsigned char *curr_in = (const unsigned char *) buffer_in;
@@ -83,35 +469,31 @@ lzm_decode(
 	const unsigned char * const out_limit = buffer_out + *size_out;
 	const unsigned char *out_limit_fast_path;
 	unsigned char *match;
-	unsigned char *mend;
-	unsigned long int c;
 	unsigned int llen;
 	unsigned int mlen;
 	unsigned int off = 1;
+	unsigned int rep[REP_COUNT] = REP_INIT;
 	unsigned char op;
 
-	(void)state;
-
-	if (buffer_in == NULL || buffer_out == NULL)
-		return EINVAL;
-
 	out_limit_fast_path = (*size_out < (14 + 14 + MIN_MATCH)) ? NULL :
 		out_limit - (14 + 14 + MIN_MATCH);
 
-	while (likely(curr_in <= match_end)) {
+	while (likely(trusted || curr_in <= match_end)) {
 		op = *curr_in++;
 		llen = op >> 4;
 		mlen = (op & 15) + MIN_MATCH;
 
 		curr_in = decode_offset(curr_in, &off);
+		if (format == LZM_FORMAT_2 && likely(off != 0))
+			off = rep_decode(rep, off);
 
 		if (likely(llen < 15 && (curr_in + 16) <= end &&
-		    curr_out <= out_limit_fast_path)) {
+		    (trusted || curr_out <= out_limit_fast_path))) {
 			LOG("L %d\n", llen);
 			memcpy(curr_out, curr_in, 16);
 			curr_out += llen;
 			curr_in += llen;
-			if (unlikely(off > (curr_out - buffer_out)))
+			if (!trusted && unlikely(off > (curr_out - low)))
 				return EIO;
 			if (likely(mlen < (15 + MIN_MATCH) &&
 			    likely(((off >= mlen) | (off >= 8))))) {
@@ -128,23 +510,23 @@ lzm_decode(
 
 		if (likely(llen > 0)) {
 			if (unlikely(llen == 15)) {
-				if (unlikely(curr_in >= end - 15))
+				if (!trusted && unlikely(curr_in >= end - 15))
 					return EIO;
 
 				curr_in = decode_length(curr_in, &llen);
 				llen += 15;
 			}
 			LOG("L %d\n", llen);
-			if (unlikely((curr_in + llen) > end))
+			if (!trusted && unlikely((curr_in + llen) > end))
 				return EIO;
-			if (unlikely((curr_out + llen) > out_limit))
+			if (!trusted && unlikely((curr_out + llen) > out_limit))
 				return EOVERFLOW;
-			memcpy(curr_out, curr_in, llen);
+			copy_literals(curr_out, curr_in, llen, nt);
 			curr_in += llen;
 			curr_out += llen;
 		}
 
-		if (unlikely(off > (curr_out - buffer_out)))
+		if (!trusted && unlikely(off > (curr_out - low)))
 			return EIO;
 
  match:
@@ -152,7 +534,7 @@ lzm_decode(
 			break;
 
 		if (likely(mlen < (15 + MIN_MATCH) && off >= mlen &&
-		    (curr_out + (14 + MIN_MATCH)) <= out_limit)) {
+		    (trusted || (curr_out + (14 + MIN_MATCH)) <= out_limit))) {
 			LOG("M %d %d\n", mlen, off);
 			match = curr_out - off;
 			memcpy(curr_out, match, 8);
@@ -163,7 +545,7 @@ lzm_decode(
 		}
 
 		if (likely(mlen == (15 + MIN_MATCH))) {
-			if (unlikely(curr_in >= match_end))
+			if (!trusted && unlikely(curr_in >= match_end))
 				return EIO;
 
 			curr_in = decode_length(curr_in, &mlen);
@@ -171,101 +553,160 @@ lzm_decode(
 		}
 
 		LOG("M %d %d\n", mlen, off);
-		if (unlikely((curr_out + mlen) > out_limit))
+		if (!trusted && unlikely((curr_out + mlen) > out_limit))
 			return EOVERFLOW;
 
-		match = curr_out - off;
-		mend = curr_out + mlen;
+		curr_out = decode_match(curr_out, off, mlen, out_limit,
+		    trusted);
+	}
+
+	*size_out = curr_out - buffer_out;
 
-		if (likely(mlen <= off)) {
-			memcpy(curr_out, match, mlen);
-			curr_out += mlen;
-			continue;
-		}
+	/* Finished without seeing end of stream? */
+	if (off != 0)
+		return EIO;
 
-		if (off == 1) {
-			c = *match;
-			*curr_out++ = c;
-			*curr_out++ = c;
-			*curr_out++ = c;
-			*curr_out++ = c;
-			while (curr_out < mend)
-				*curr_out++ = c;
-			continue;
-		}
+	return 0;
+}
 
-		if (off == 2) {
-			c = readmem16(match);
-			writemem16(curr_out, c);
-			curr_out += 2;
-			writemem16(curr_out, c);
-			curr_out += 2;
-			while (curr_out < mend) {
-				writemem16(curr_out, c);
-				curr_out += 2;
-				writemem16(curr_out, c);
-				curr_out += 2;
-			}
-			curr_out = mend;
-			continue;
-		}
+/*
+ * A parsed sequence: llen literals at lit followed by a match of mlen bytes
+ * from off back, off 0 for the closing literals.
+ */
+struct lzm_seq {
+	const unsigned char *lit;
+	unsigned int llen;
+	unsigned int mlen;
+	unsigned int off;
+};
+
+/*
+ * As lzm_decode_format() but in two passes over batches of DECODE_BATCH
+ * sequences.  The first parses and checks them and prefetches each match
+ * source, the second does the copies, by which time far sources are on
+ * their way into the cache instead of each stalling the copy.
+ */
+static inline __attribute__((always_inline)) unsigned int
+lzm_decode_batch(
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out,
+    const unsigned int prefix,
+    const unsigned int format,
+    const unsigned int nt)
+{
+	const unsigned char * const low = buffer_out - prefix;
+	const unsigned char * const end = buffer_in + size_in;
+	const unsigned char * const match_end = end - 5;
+	const unsigned char *curr_in = (const unsigned char *) buffer_in;
+	unsigned char *curr_out = (unsigned char *) buffer_out;
+	const unsigned char * const out_limit = buffer_out + *size_out;
+	const unsigned char *out_limit_fast_path;
+	const unsigned char *next_out;
+	const unsigned char *match;
+	struct lzm_seq seq[DECODE_BATCH];
+	unsigned int llen;
+	unsigned int mlen;
+	unsigned int off = 1;
+	unsigned int rep[REP_COUNT] = REP_INIT;
+	unsigned int i, n;
+	unsigned char op;
 
-		if (off == 3) {
-			unsigned char c1, c2, c3;
-			c1 = *match;
-			c2 = *(match+1);
-			c3 = *(match+2);
-			*curr_out++ = c1;
-			*curr_out++ = c2;
-			*curr_out++ = c3;
-			*curr_out++ = c1;
-			*curr_out++ = c2;
-			*curr_out++ = c3;
-			while (curr_out < mend) {
-				*curr_out++ = c1;
-				*curr_out++ = c2;
-				*curr_out++ = c3;
-			}
-			curr_out = mend;
-		}
+	out_limit_fast_path = (*size_out < (14 + 14 + MIN_MATCH)) ? NULL :
+		out_limit - (14 + 14 + MIN_MATCH);
 
-		if (off == 4) {
-			c = readmem32(match);
-			writemem32(curr_out, c);
-			curr_out += off;
-			writemem32(curr_out, c);
-			curr_out += off;
-			while (curr_out < mend) {
-				writemem32(curr_out, c);
-				curr_out += off;
-				writemem32(curr_out, c);
-				curr_out += off;
+	while (likely(curr_in <= match_end && off != 0)) {
+		next_out = curr_out;
+		n = 0;
+		do {
+			op = *curr_in++;
+			llen = op >> 4;
+			mlen = (op & 15) + MIN_MATCH;
+
+			curr_in = decode_offset(curr_in, &off);
+			if (format == LZM_FORMAT_2 && likely(off != 0))
+				off = rep_decode(rep, off);
+
+			seq[n].lit = curr_in;
+			if (likely(llen < 15 && mlen < (15 + MIN_MATCH) &&
+			    (curr_in + 16) <= end &&
+			    next_out <= out_limit_fast_path)) {
+				curr_in += llen;
+				next_out += llen;
+				if (unlikely(off > (next_out - low)))
+					return EIO;
+			} else {
+				if (unlikely(llen == 15)) {
+					if (unlikely(curr_in >= end - 15))
+						return EIO;
+
+					curr_in = decode_length(curr_in, &llen);
+					llen += 15;
+					seq[n].lit = curr_in;
+				}
+				if (unlikely((curr_in + llen) > end))
+					return EIO;
+				if (unlikely((next_out + llen) > out_limit))
+					return EOVERFLOW;
+				curr_in += llen;
+				next_out += llen;
+				if (unlikely(off > (next_out - low)))
+					return EIO;
+				if (unlikely(off == 0)) {
+					seq[n].llen = llen;
+					seq[n].mlen = mlen;
+					seq[n++].off = 0;
+					break;
+				}
+
+				if (unlikely(mlen == (15 + MIN_MATCH))) {
+					if (unlikely(curr_in >= match_end))
+						return EIO;
+
+					curr_in = decode_length(curr_in, &mlen);
+					mlen += 15 + MIN_MATCH;
+				}
+				if (unlikely((next_out + mlen) > out_limit))
+					return EOVERFLOW;
 			}
-			curr_out = mend;
-			continue;
-		}
 
-		if (off <= 8) {
-			c = readmem64(match);
-			writemem64(curr_out, c);
-			curr_out += off;
-			while (curr_out < mend) {
-				writemem64(curr_out, c);
-				curr_out += off;
+			__builtin_prefetch(next_out - off);
+			seq[n].llen = llen;
+			seq[n].mlen = mlen;
+			seq[n++].off = off;
+			next_out += mlen;
+		} while (likely(n < DECODE_BATCH && off != 0 &&
+		    curr_in <= match_end));
+
+		for (i = 0; i < n; i++) {
+			llen = seq[i].llen;
+			mlen = seq[i].mlen;
+			if (likely(llen < 15 && mlen < (15 + MIN_MATCH) &&
+			    (seq[i].lit + 16) <= end &&
+			    curr_out <= out_limit_fast_path)) {
+				memcpy(curr_out, seq[i].lit, 16);
+				curr_out += llen;
+				if (likely((seq[i].off >= mlen) |
+				    (seq[i].off >= 8))) {
+					LOG("M %d %d\n", mlen, seq[i].off);
+					match = curr_out - seq[i].off;
+					memcpy(curr_out, match, 8);
+					memcpy(curr_out+8, match+8, 8);
+					memcpy(curr_out+16, match+16, 2);
+					curr_out += mlen;
+					continue;
+				}
+			} else {
+				copy_literals(curr_out, seq[i].lit, llen, nt);
+				curr_out += llen;
 			}
-			curr_out = mend;
-			continue;
-		}
+			if (unlikely(seq[i].off == 0))
+				break;
 
-		memcpy(curr_out, match, 4);
-		match += 4;
-		curr_out += 4;
-		while (curr_out < mend) {
-			memcpy(curr_out, match, 8);
-			match += 8;
-			curr_out += 8;
+			curr_out = decode_match(curr_out, seq[i].off, mlen,
+			    out_limit, false);
 		}
-		curr_out = mend;
 	}
 
 	*size_out = curr_out - buffer_out;
@@ -276,3 +717,157 @@ lzm_decode(
 
 	return 0;
 }
+
+static unsigned int
+lzm_decode_prefix(const struct lzm_state * const state,
+    const unsigned char * const buffer_in, const unsigned int size_in,
+    unsigned char * const buffer_out, unsigned int * const size_out,
+    const unsigned int prefix, const unsigned int nt)
+{
+	if (state != NULL && state->batch &&
+	    prefix + *size_out > DECODE_BATCH_MIN) {
+		if (state->format == LZM_FORMAT_2)
+			return lzm_decode_batch(buffer_in, size_in,
+			    buffer_out, size_out, prefix, LZM_FORMAT_2, nt);
+
+		return lzm_decode_batch(buffer_in, size_in, buffer_out,
+		    size_out, prefix, LZM_FORMAT_1, nt);
+	}
+
+	if (state != NULL && state->format == LZM_FORMAT_2)
+		return lzm_decode_format(buffer_in, size_in, buffer_out,
+		    size_out, prefix, LZM_FORMAT_2, false, nt);
+
+	return lzm_decode_format(buffer_in, size_in, buffer_out, size_out,
+	    prefix, LZM_FORMAT_1, false, nt);
+}
+
+static unsigned int
+lzm_decode_prefix_trusted(const struct lzm_state * const state,
+    const unsigned char * const buffer_in, const unsigned int size_in,
+    unsigned char * const buffer_out, unsigned int * const size_out,
+    const unsigned int prefix, const unsigned int nt)
+{
+	if (state != NULL && state->format == LZM_FORMAT_2)
+		return lzm_decode_format(buffer_in, size_in, buffer_out,
+		    size_out, prefix, LZM_FORMAT_2, true, nt);
+
+	return lzm_decode_format(buffer_in, size_in, buffer_out, size_out,
+	    prefix, LZM_FORMAT_1, true, nt);
+}
+
+/*
+ * Stream mode.  Output is decoded after the history window, where matches
+ * can reach back into the data of earlier calls or the dictionary, then
+ * copied out.  The window stays in the cache, so a large output is only
+ * streamed past it on the copy out.
+ */
+static unsigned int
+lzm_decode_stream(const struct lzm_state * const state,
+    const unsigned char * const buffer_in, const unsigned int size_in,
+    unsigned char * const buffer_out, unsigned int * const size_out,
+    const unsigned int trusted)
+{
+	struct lzm_window * const w = state->window;
+	unsigned int prefix;
+	int error;
+
+	if (trusted && *size_out > STREAM_MAX_INPUT)
+		return EINVAL;
+
+	error = lzm_window_reserve(w, *size_out +
+	    (trusted ? LZM_DECODE_MARGIN : 0), &prefix);
+	if (error != 0)
+		return error;
+
+	if (trusted)
+		error = lzm_decode_prefix_trusted(state, buffer_in, size_in,
+		    w->buf + w->used, size_out, prefix, false);
+	else
+		error = lzm_decode_prefix(state, buffer_in, size_in,
+		    w->buf + w->used, size_out, prefix, false);
+	if (error != 0)
+		return error;
+
+	if (decode_nt(*size_out))
+		copy_nt(buffer_out, w->buf + w->used, *size_out);
+	else
+		memcpy(buffer_out, w->buf + w->used, *size_out);
+	if (w->linked)
+		w->used += *size_out;
+
+	return 0;
+}
+
+unsigned int
+lzm_decode(
+    const struct lzm_state * const state,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out)
+{
+	if (buffer_in == NULL || buffer_out == NULL)
+		return EINVAL;
+
+	if (state != NULL && state->window != NULL)
+		return lzm_decode_stream(state, buffer_in, size_in,
+		    buffer_out, size_out, false);
+
+	return lzm_decode_prefix(state, buffer_in, size_in, buffer_out,
+	    size_out, 0, decode_nt(*size_out));
+}
+
+/*
+ * Decode the size_in bytes of compressed data at the end of buffer to its
+ * start, so a single buffer of the decompressed size and
+ * lzm_decode_margin() serves for both.  *size_out is limited to what fits
+ * ahead of the margin.
+ */
+unsigned int
+lzm_decode_in_place(
+    const struct lzm_state * const state,
+    unsigned char * const buffer,
+    const unsigned int buffer_size,
+    const unsigned int size_in,
+    unsigned int * const size_out)
+{
+	const unsigned int margin = lzm_decode_margin(size_in);
+
+	if (buffer == NULL || size_in > buffer_size)
+		return EINVAL;
+
+	if (buffer_size < margin)
+		return EOVERFLOW;
+
+	*size_out = MIN(*size_out, buffer_size - margin);
+
+	return lzm_decode(state, buffer + buffer_size - size_in, size_in,
+	    buffer, size_out);
+}
+
+/*
+ * As lzm_decode() without validating the input, for data known to come
+ * from lzm_encode() intact, e.g. written by this process or checksummed.
+ * The output must fit in *size_out, and buffer_out must have
+ * LZM_DECODE_MARGIN bytes more that may be overwritten.  Corrupt input
+ * reads and writes out of bounds.
+ */
+unsigned int
+lzm_decode_trusted(
+    const struct lzm_state * const state,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out)
+{
+	if (buffer_in == NULL || buffer_out == NULL)
+		return EINVAL;
+
+	if (state != NULL && state->window != NULL)
+		return lzm_decode_stream(state, buffer_in, size_in,
+		    buffer_out, size_out, true);
+
+	return lzm_decode_prefix_trusted(state, buffer_in, size_in,
+	    buffer_out, size_out, 0, decode_nt(*size_out));
+}
@@ -3,7 +3,14 @@
 #include <sys/param.h>
 #include <sys/errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <unistd.h>
+#if defined(__AVX2__) || defined(__AVX512BW__)
+#include <immintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,9 +29,90 @@ struct prev_match {
 	const unsigned char *lit_start;
 	const unsigned char *start;
 	const unsigned char *last;
+	unsigned int *rep;
 	unsigned int length;
 };
 
+/*
+ * One call to a codec.  The input can be encoded in several calls with long
+ * distance matches output between them, so the literals pending from
+ * lit_start and the repeat offsets carry over and only the last call ends
+ * the stream.
+ */
+struct lzm_block {
+	const unsigned char *lit_start;
+	unsigned int rep[REP_COUNT];
+	unsigned int last;
+};
+
+struct opt_node {
+	unsigned int price;
+	unsigned int litlen;
+	unsigned int mlen;
+	unsigned int off;
+};
+
+struct opt_match {
+	unsigned int len;
+	unsigned int off;
+};
+
+struct opt_seq {
+	unsigned int pos;
+	unsigned int len;
+	unsigned int off;
+};
+
+struct bt_node {
+	unsigned int child[2];
+};
+
+struct lzm_opt {
+	struct opt_node node[OPT_NUM + 1];
+	struct opt_seq seq[OPT_NUM / MIN_MATCH + 2];
+};
+
+/*
+ * Running table index for independent calls.  Each call indexes its input
+ * from pos, beyond anything already in the tables, so entries left by earlier
+ * calls fall below the input and are rejected like any other out of reach
+ * match.  The tables then only need clearing when pos is about to wrap, or
+ * when they are small next to the input, as stale entries that still match
+ * the token cost more in mispredicted branches than clearing does.
+ */
+struct lzm_epoch {
+	unsigned int pos;
+	unsigned int reset;
+};
+
+/*
+ * Long distance matching.  A gear hash rolls over the input, covering the
+ * last 64 bytes, and positions where its top LDM_SAMPLE_ORDER bits are clear
+ * are anchors, so the same content picks the same anchors wherever it is.
+ * Anchors are kept in a table indexed by the hash, reaching back over the
+ * whole window.
+ */
+struct lzm_ldm {
+	struct ht_entry *table;
+	unsigned long gear[256];
+};
+
+/*
+ * The tables as they were after loading a dictionary.  After each call the
+ * entries it can have written are put back from here.  Only the part of the
+ * chains covering the dictionary is kept.
+ */
+struct lzm_dict {
+	struct ht_entry *last_ht;
+	unsigned char *chains;
+	unsigned int chain_bytes;
+};
+
+struct dict_segment {
+	unsigned int score;
+	unsigned int index;
+};
+
 /*
  * Estimate worst case size of compressed data.
  */
@@ -36,10 +124,31 @@ lzm_compressed_size(const unsigned int size)
 	return (csize < size) ? size : csize;
 }
 
+/*
+ * Size of output buffer that the encoder can not overflow, however badly
+ * the input compresses.  A token costs at most one byte more than the four
+ * or more bytes it covers, plus the last literals and the bytes written
+ * past the end by the wide copies.  Given this much lzm_encode() skips the
+ * per sequence checks where it can.
+ */
+unsigned int
+lzm_encode_bound(const unsigned int size)
+{
+	const unsigned long bsize = size + (size >> 2) + 32UL;
+
+	return (bsize > ~0U) ? ~0U : bsize;
+}
+
+static inline unsigned int
+hash_lazy(const unsigned long seq, const unsigned int hash_order)
+{
+	return ((seq * 0xAC565CAC35000000) >> (64 - hash_order));
+}
+
 static inline unsigned int
-hash_fast(const unsigned long seq)
+hash_long(const unsigned long seq, const unsigned int hash_order)
 {
-	return ((seq * 0xAC565CAC35000000) >> (64 - HASH_ORDER_FAST));
+	return ((seq * 0x9E3779B185EBCA87) >> (64 - hash_order));
 }
 
 static inline unsigned int
@@ -48,9 +157,96 @@ hash_high(const unsigned int seq, const unsigned int hash_order)
 	return (seq * 2654435761U) >> (32 - hash_order);
 }
 
+/*
+ * Bit i set when way i of the bucket holds token.  A bucket is one cache line
+ * of BUCKET_WAYS entries, most recent first.
+ */
+static inline unsigned int
+bucket_find(const struct ht_entry * const bucket, const unsigned int token)
+{
+#ifdef __AVX2__
+	const __m256i odd = _mm256_setr_epi32(1, 3, 5, 7, 1, 3, 5, 7);
+	const __m256i lo = _mm256_load_si256((const __m256i *)bucket);
+	const __m256i hi = _mm256_load_si256((const __m256i *)(bucket + 4));
+	__m256i tokens;
+
+	/* Gather the eight tokens out of the index/token pairs */
+	tokens = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(lo, odd),
+	    _mm256_permutevar8x32_epi32(hi, odd), 0xF0);
+
+	return _mm256_movemask_ps(_mm256_castsi256_ps(
+	    _mm256_cmpeq_epi32(tokens, _mm256_set1_epi32(token))));
+#else
+	unsigned int mask = 0;
+	unsigned int i;
+
+	for (i = 0; i < BUCKET_WAYS; i++)
+		mask |= (bucket[i].token == token) << i;
+
+	return mask;
+#endif
+}
+
+/*
+ * Age the bucket by one and make index the most recent way.
+ */
+static inline void
+bucket_insert(struct ht_entry * const bucket, const unsigned int index,
+    const unsigned int token)
+{
+#ifdef __AVX2__
+	const __m256i lo = _mm256_load_si256((const __m256i *)bucket);
+	const __m256i hi = _mm256_load_si256((const __m256i *)(bucket + 4));
+	const __m256i rlo = _mm256_permute4x64_epi64(lo, 0x93);
+	const __m256i rhi = _mm256_permute4x64_epi64(hi, 0x93);
+	const __m256i entry = _mm256_set1_epi64x(
+	    ((unsigned long)token << 32) | index);
+
+	/* Rotate each half up one way, carrying way 3 over into the top */
+	_mm256_store_si256((__m256i *)bucket,
+	    _mm256_blend_epi32(rlo, entry, 0x03));
+	_mm256_store_si256((__m256i *)(bucket + 4),
+	    _mm256_blend_epi32(rhi, rlo, 0x03));
+#else
+	memmove(bucket + 1, bucket, (BUCKET_WAYS - 1) * sizeof(*bucket));
+	bucket[0].index = index;
+	bucket[0].token = token;
+#endif
+}
+
 __attribute__((aligned(64)))
 unsigned char run[9] = { 0, 8, 8, 6, 8, 5, 6, 7, 8 };
 
+/*
+ * Long matches are extended VEC_BYTES at a time, vec_diff() has bit i set
+ * where byte i of the two blocks differs.
+ */
+#if defined(__AVX512BW__)
+#define VEC_BYTES	64
+
+static inline unsigned long
+vec_diff(const unsigned char * const a, const unsigned char * const b)
+{
+	return _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(a),
+	    _mm512_loadu_si512(b));
+}
+#elif defined(__AVX2__)
+#define VEC_BYTES	32
+
+static inline unsigned long
+vec_diff(const unsigned char * const a, const unsigned char * const b)
+{
+	return ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+	    _mm256_loadu_si256((const __m256i *)a),
+	    _mm256_loadu_si256((const __m256i *)b)));
+}
+#endif
+
+#ifdef VEC_BYTES
+/* Matching bytes at the top of a block, for backward extension */
+#define vec_clz(diff)	(__builtin_clzl(diff) - (64 - VEC_BYTES))
+#endif
+
 static inline int
 matchlen_run(const unsigned char * const start,
     const unsigned char * const match, const unsigned char * const end,
@@ -60,6 +256,9 @@ matchlen_run(const unsigned char * const start,
 	const unsigned char *last = match;
 	const unsigned int off = start - match;
 	unsigned long currval, lastval;
+#ifdef VEC_BYTES
+	unsigned long diff;
+#endif
 
 	if (last < (end - 7)) {
 		lastval = readmem64(last);
@@ -70,6 +269,16 @@ matchlen_run(const unsigned char * const start,
 				return (__builtin_ctzl(lastval ^ currval) >> 3);
 			curr += bytes;
 		}
+#ifdef VEC_BYTES
+		while (curr < (end - (VEC_BYTES - 1))) {
+			diff = vec_diff(curr, curr - off);
+			if (diff != 0)
+				return (curr - start) + __builtin_ctzl(diff);
+			curr += VEC_BYTES;
+		}
+		/* The run repeats every bytes, so this is the next expected */
+		lastval = readmem64(curr - off);
+#endif
 		while (curr < (end - 7)) {
 			currval = readmem64(curr);
 			if (lastval != currval) {
@@ -108,6 +317,9 @@ matchlen(const unsigned char * const start, const unsigned char * const match,
 	const unsigned char *last = match;
 	unsigned long currval, lastval;
 	const unsigned int off = start - match;
+#ifdef VEC_BYTES
+	unsigned long diff;
+#endif
 
 	if (off <= 8)
 		return matchlen_run(start, match, end, run[off]);
@@ -120,6 +332,15 @@ matchlen(const unsigned char * const start, const unsigned char * const match,
 		last += 8;
 		curr += 8;
 	}
+#ifdef VEC_BYTES
+	while (curr < (end - (VEC_BYTES - 1))) {
+		diff = vec_diff(curr, last);
+		if (diff != 0)
+			return (curr - start) + __builtin_ctzl(diff);
+		last += VEC_BYTES;
+		curr += VEC_BYTES;
+	}
+#endif
 	while (curr < (end - 7)) {
 		lastval = readmem64(last);
 		currval = readmem64(curr);
@@ -161,6 +382,9 @@ matchlen_rev(const unsigned char * const start, const unsigned char * const matc
 	const unsigned char *end;
 	unsigned long currval, lastval;
 	unsigned int off;
+#ifdef VEC_BYTES
+	unsigned long diff;
+#endif
 
 	if (start == start_limit)
 		return 0;
@@ -186,6 +410,15 @@ matchlen_rev(const unsigned char * const start, const unsigned char * const matc
 		curr = next_curr;
 		last = next_last;
 	}
+#ifdef VEC_BYTES
+	while (last > (end + (VEC_BYTES - 1))) {
+		diff = vec_diff(curr - VEC_BYTES, last - VEC_BYTES);
+		if (diff != 0)
+			return (start - curr) + vec_clz(diff);
+		curr -= VEC_BYTES;
+		last -= VEC_BYTES;
+	}
+#endif
 	while (last > (end + 7)) {
 		next_curr = curr - 8;
 		next_last = last - 8;
@@ -359,18 +592,71 @@ output_data(unsigned char *out, const unsigned char * const start,
 	return out;
 }
 
+/*
+ * Format 2 offset codes.  Codes 1 to REP_COUNT repeat one of the most recent
+ * offsets, larger codes are the offset plus REP_COUNT.  The history is kept
+ * most recent first and every offset output moves to the front of it.
+ */
+static inline unsigned int
+rep_encode(unsigned int * const rep, const unsigned int offset)
+{
+	unsigned int code;
+	unsigned int i;
+
+	for (i = 0; i < REP_COUNT; i++) {
+		if (rep[i] == offset)
+			break;
+	}
+
+	if (i < REP_COUNT) {
+		code = i + 1;
+	} else {
+		code = offset + REP_COUNT;
+		i--;
+	}
+
+	for (; i > 0; i--)
+		rep[i] = rep[i - 1];
+	rep[0] = offset;
+
+	return code;
+}
+
+/*
+ * Farthest match the format can code.  Format 2 codes new offsets REP_COUNT
+ * higher, so the finders leave the top REP_COUNT distances alone.
+ */
+static inline unsigned int
+offset_limit(const unsigned int format)
+{
+	return (format == LZM_FORMAT_2) ? MAX_OFFSET_MASK - REP_COUNT :
+	    MAX_OFFSET_MASK;
+}
+
+/*
+ * The output routines return NULL when the sequence may not fit before
+ * out_limit.  Codecs writing to a buffer of lzm_encode_bound() bytes pass a
+ * NULL out_limit, which drops the check.
+ */
 static inline unsigned char *
 output_match(unsigned char * const out, const unsigned char * const start,
     const unsigned int literals, const unsigned int offset,
-    const unsigned int length, const unsigned char * const out_limit)
+    const unsigned int length, const unsigned char * const out_limit,
+    unsigned int * const rep)
 {
+	unsigned int code = offset;
+
 	LOG("L %d\n", literals);
 	LOG("M %d %d\n", length, offset);
 
-	if ((out + literals + (1 + 5 + 5 + 4 + 8)) > out_limit)
+	if (out_limit != NULL &&
+	    (out + literals + (1 + 5 + 5 + 4 + 8)) > out_limit)
 		return NULL;
 
-	return output_data(out, start, literals, offset, length - MIN_MATCH);
+	if (rep != NULL)
+		code = rep_encode(rep, offset);
+
+	return output_data(out, start, literals, code, length - MIN_MATCH);
 }
 
 static inline unsigned char *
@@ -379,7 +665,8 @@ output_literals(unsigned char * const out, const unsigned char * const start,
 {
 	LOG("L %d\n", literals);
 
-	if ((out + literals + (1 + 5 + 1 + 10)) > out_limit)
+	if (out_limit != NULL &&
+	    (out + literals + (1 + 5 + 1 + 10)) > out_limit)
 		return NULL;
 
 	return output_data(out, start, literals, 0, 0);
@@ -391,15 +678,36 @@ output_match_last(struct prev_match * const prev, unsigned char *out,
 {
 	out = output_match(out, prev->lit_start,
 	    prev->start - prev->lit_start, prev->start - prev->last,
-	    prev->length, out_limit);
+	    prev->length, out_limit, prev->rep);
 	prev->lit_start = prev->start + prev->length;
 
 	return out;
 }
 
+/*
+ * Finish a codec call, ending the stream with the remaining literals or
+ * leaving them pending for the next call.
+ */
+static inline unsigned char *
+output_block_end(struct lzm_block * const block, unsigned char * const out,
+    const unsigned char * const lit_start, const unsigned char * const end,
+    const unsigned char * const out_limit, const unsigned int * const rep)
+{
+	if (rep != NULL)
+		memcpy(block->rep, rep, sizeof(block->rep));
+
+	if (!block->last) {
+		block->lit_start = lit_start;
+		return out;
+	}
+
+	return output_literals(out, lit_start, end - lit_start, out_limit);
+}
+
 static inline unsigned char *
 output_match_final(struct prev_match * const prev, unsigned char *out,
-    const unsigned char * const end, const unsigned char * const out_limit)
+    const unsigned char * const end, const unsigned char * const out_limit,
+    struct lzm_block * const block)
 {
 	if (likely(prev->length > 0)) {
 		out = output_match_last(prev, out, out_limit);
@@ -407,8 +715,8 @@ output_match_final(struct prev_match * const prev, unsigned char *out,
 			return NULL;
 	}
 
-	return output_literals(out, prev->lit_start, end - prev->lit_start,
-	    out_limit);
+	return output_block_end(block, out, prev->lit_start, end, out_limit,
+	    prev->rep);
 }
 
 static inline unsigned char *
@@ -436,32 +744,85 @@ output_match_merge(struct prev_match * const prev, unsigned char *out,
 
 static inline void
 lzm_reset(const struct lzm_state * const state,
-    const unsigned char * const buffer_in)
+    const unsigned char * const base, const unsigned char * const curr_in)
 {
 	struct ht_entry ht;
 	unsigned int i;
 
-	ht.index = 0;
-	ht.token = readmem32(buffer_in);
+	ht.index = curr_in - base;
+	ht.token = readmem32(curr_in);
 
 	for (i = 0; i < state->hash_buckets; i++)
 		state->last_ht[i] = ht;
 }
 
+/*
+ * Longest match at curr_in against one of the repeat offsets.  In format 2
+ * these cost a single byte whatever their distance.
+ */
+static inline unsigned int
+lzm_rep_find(const unsigned char * const low,
+    const unsigned char * const curr_in, const unsigned char * const match_end,
+    const unsigned int * const rep, unsigned int * const offset)
+{
+	const unsigned int token = readmem32(curr_in);
+	const unsigned int avail = curr_in - low;
+	unsigned int best = 0;
+	unsigned int len;
+	unsigned int i;
+
+	for (i = 0; i < REP_COUNT; i++) {
+		if (rep[i] > avail || token != readmem32(curr_in - rep[i]))
+			continue;
+		len = MIN_MATCH + matchlen(curr_in + MIN_MATCH,
+		    curr_in - rep[i] + MIN_MATCH, match_end);
+		if (len > best) {
+			best = len;
+			*offset = rep[i];
+		}
+	}
+
+	return best;
+}
+
+/*
+ * The repeat offsets as they will be once a pending match is output.
+ */
+static inline const unsigned int *
+lzm_rep_pending(const struct prev_match * const prev,
+    unsigned int * const pending)
+{
+	unsigned int i;
+
+	if (prev->length == 0)
+		return prev->rep;
+
+	pending[0] = prev->start - prev->last;
+	for (i = 1; i < REP_COUNT; i++)
+		pending[i] = prev->rep[i - 1];
+
+	return pending;
+}
+
 static unsigned int
 lzm_encode_none(
     const struct lzm_state * const state,
+    const unsigned char * const base,
+    const unsigned char * const low,
     const unsigned char * const buffer_in,
     const unsigned int size_in,
     unsigned char * const buffer_out,
-    unsigned int * const size_out)
+    unsigned int * const size_out,
+    struct lzm_block * const block)
 {
 	unsigned char *curr_out;
 
 	(void)state;
+	(void)base;
+	(void)low;
 
-	curr_out = output_literals(buffer_out, buffer_in, size_in,
-	    buffer_out + *size_out);
+	curr_out = output_block_end(block, buffer_out, block->lit_start,
+	    buffer_in + size_in, buffer_out + *size_out, NULL);
 	if (curr_out == NULL)
 		return EOVERFLOW;
 
@@ -469,19 +830,44 @@ lzm_encode_none(
 	return 0;
 }
 
-static unsigned int
-lzm_encode_fast(
+/*
+ * Whether the output buffer holds lzm_encode_bound() of everything the call
+ * may emit, the pending literals included, so the codec can run unchecked.
+ */
+static inline unsigned int
+lzm_output_bounded(const unsigned char * const buffer_in,
+    const unsigned int size_in, const unsigned int size_out,
+    const struct lzm_block * const block)
+{
+	return size_out >= lzm_encode_bound(buffer_in + size_in -
+	    block->lit_start);
+}
+
+/*
+ * Greedy matching with a single probe hash table.  Positions are tried step
+ * bytes apart and every MISS_ORDER misses in a row lengthen the stride by
+ * another byte.
+ */
+static inline __attribute__((always_inline)) unsigned int
+lzm_encode_fast_step(
     const struct lzm_state * const state,
+    const unsigned char * const base,
+    const unsigned char * const low,
     const unsigned char * const buffer_in,
     const unsigned int size_in,
     unsigned char * const buffer_out,
-    unsigned int * const size_out)
+    unsigned int * const size_out,
+    struct lzm_block * const block,
+    const unsigned int hash_order,
+    const unsigned int step,
+    const unsigned int checked)
 {
 	const unsigned char * const end = buffer_in + size_in;
 	const unsigned char * const match_end = end - 7;
 	const unsigned char * const scan_end = match_end - 7;
-	const unsigned char * const out_limit = buffer_out + *size_out;
-	const unsigned char *lit_start = buffer_in;
+	const unsigned char * const out_limit =
+	    checked ? buffer_out + *size_out : NULL;
+	const unsigned char *lit_start = block->lit_start;
 	const unsigned char *curr_in = buffer_in;
 	const unsigned char *next_curr;
 	const unsigned char *last;
@@ -492,18 +878,22 @@ lzm_encode_fast(
 	unsigned int last_token;
 	unsigned int len;
 	unsigned int off;
-	unsigned int misses = (1 << MISS_ORDER) + 1;
+	unsigned int misses = (step << MISS_ORDER) + 1;
 	unsigned int hashval;
 	unsigned int next_hashval;
+	const unsigned int max_off = offset_limit(state->format);
+	unsigned int reps[REP_COUNT];
+	unsigned int * const rep =
+	    (state->format == LZM_FORMAT_2) ? reps : NULL;
 
-	lzm_reset(state, buffer_in);
+	memcpy(reps, block->rep, sizeof(reps));
 
 	token = readmem64(curr_in);
-	hashval = hash_fast(token);
+	hashval = hash_lazy(token, hash_order);
 	next_token = readmem64(curr_in + 1);
-	next_hashval = hash_fast(next_token);
+	next_hashval = hash_lazy(next_token, hash_order);
 	last_htp = &state->last_ht[hashval];
-	last_htp->index = curr_in - buffer_in;
+	last_htp->index = curr_in - base;
 	last_htp->token = token;
 	curr_in++;
 
@@ -512,30 +902,34 @@ lzm_encode_fast(
 		hashval = next_hashval;
 		next_curr = curr_in + (misses >> MISS_ORDER);
 		next_token = readmem64(next_curr);
-		next_hashval = hash_fast(next_token);
+		next_hashval = hash_lazy(next_token, hash_order);
 		last_htp = &state->last_ht[hashval];
-		last = last_htp->index + buffer_in;
+		last = last_htp->index + base;
 		last_token = last_htp->token;
-		last_htp->index = curr_in - buffer_in;
+		last_htp->index = curr_in - base;
 		last_htp->token = token;
 
-		if ((unsigned int)token != last_token ||
-		    (curr_in - last) & ~MAX_OFFSET_MASK) {
+		/* The most recent offset is tried first, it costs one byte */
+		if (rep != NULL && rep[0] <= (unsigned int)(curr_in - low) &&
+		    (unsigned int)token == readmem32(curr_in - rep[0])) {
+			last = curr_in - rep[0];
+		} else if ((unsigned int)token != last_token || last < low ||
+		    (unsigned int)(curr_in - last) > max_off) {
 			misses++;
 			curr_in = next_curr;
 			continue;
 		}
-		misses = (1 << MISS_ORDER) + 1;
+		misses = (step << MISS_ORDER) + 1;
 
 		len = MIN_MATCH;
 		len += matchlen(curr_in + len, last + len, match_end);
-		off = matchlen_rev(curr_in, last, lit_start, buffer_in);
+		off = matchlen_rev(curr_in, last, lit_start, low);
 		curr_in -= off;
 		last -= off;
 		len += off;
 
 		curr_out = output_match(curr_out, lit_start,
-		    curr_in - lit_start, curr_in - last, len, out_limit);
+		    curr_in - lit_start, curr_in - last, len, out_limit, rep);
 		if (unlikely(curr_out == NULL))
 			return EOVERFLOW;
 
@@ -543,16 +937,16 @@ lzm_encode_fast(
 		lit_start = curr_in;
 
 		token = readmem64(curr_in - 2);
-		hashval = hash_fast(token);
+		hashval = hash_lazy(token, hash_order);
 		next_token = readmem64(curr_in);
-		next_hashval = hash_fast(next_token);
+		next_hashval = hash_lazy(next_token, hash_order);
 		last_htp = &state->last_ht[hashval];
-		last_htp->index = curr_in - 2 - buffer_in;
+		last_htp->index = curr_in - 2 - base;
 		last_htp->token = token;
 	}
 
-	curr_out = output_literals(curr_out, lit_start, end - lit_start,
-	    out_limit);
+	curr_out = output_block_end(block, curr_out, lit_start, end,
+	    out_limit, rep);
 	if (curr_out == NULL)
 		return EOVERFLOW;
 
@@ -560,99 +954,628 @@ lzm_encode_fast(
 	return 0;
 }
 
-static inline unsigned int
-lzm_offset_cost(const unsigned int length)
+/*
+ * An instance per table order and stride.  Called with constants, as the
+ * codecs below do for their levels, they are folded into the loop.
+ */
+static inline __attribute__((always_inline)) unsigned int
+lzm_encode_fast_order(
+    const struct lzm_state * const state,
+    const unsigned char * const base,
+    const unsigned char * const low,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out,
+    struct lzm_block * const block,
+    const unsigned int hash_order,
+    const unsigned int step)
 {
-	return offmap[__builtin_clz(length | !length)].bytes;
+	if (lzm_output_bounded(buffer_in, size_in, *size_out, block))
+		return lzm_encode_fast_step(state, base, low, buffer_in,
+		    size_in, buffer_out, size_out, block, hash_order, step,
+		    false);
+
+	return lzm_encode_fast_step(state, base, low, buffer_in, size_in,
+	    buffer_out, size_out, block, hash_order, step, true);
 }
 
+/*
+ * The table order is the level's own unless the host's caches moved it,
+ * which is left to a generic instance.
+ */
 static unsigned int
-lzm_encode_high(
+lzm_encode_fast(
     const struct lzm_state * const state,
+    const unsigned char * const base,
+    const unsigned char * const low,
     const unsigned char * const buffer_in,
     const unsigned int size_in,
     unsigned char * const buffer_out,
-    unsigned int * const size_out)
+    unsigned int * const size_out,
+    struct lzm_block * const block)
+{
+	if (state->hash_order == HASH_ORDER_FAST)
+		return lzm_encode_fast_order(state, base, low, buffer_in,
+		    size_in, buffer_out, size_out, block, HASH_ORDER_FAST, 1);
+
+	return lzm_encode_fast_order(state, base, low, buffer_in, size_in,
+	    buffer_out, size_out, block, state->hash_order, 1);
+}
+
+/*
+ * The accelerated levels, chain_length is the starting stride.  With their
+ * smaller tables they trade ratio for speed beyond level 1.  Each level has
+ * its own instance as lzm_encode_fast() does.
+ */
+static unsigned int
+lzm_encode_accel(
+    const struct lzm_state * const state,
+    const unsigned char * const base,
+    const unsigned char * const low,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out,
+    struct lzm_block * const block)
+{
+	const unsigned int order = state->hash_order;
+	const unsigned int step = state->chain_length;
+
+	if (order == HASH_ORDER_ACCEL && step == 2)
+		return lzm_encode_fast_order(state, base, low, buffer_in,
+		    size_in, buffer_out, size_out, block, HASH_ORDER_ACCEL, 2);
+	if (order == HASH_ORDER_ACCEL && step == 3)
+		return lzm_encode_fast_order(state, base, low, buffer_in,
+		    size_in, buffer_out, size_out, block, HASH_ORDER_ACCEL, 3);
+	if (order == HASH_ORDER_ACCEL - 1 && step == 4)
+		return lzm_encode_fast_order(state, base, low, buffer_in,
+		    size_in, buffer_out, size_out, block,
+		    HASH_ORDER_ACCEL - 1, 4);
+	if (order == HASH_ORDER_ACCEL - 1 && step == 6)
+		return lzm_encode_fast_order(state, base, low, buffer_in,
+		    size_in, buffer_out, size_out, block,
+		    HASH_ORDER_ACCEL - 1, 6);
+
+	return lzm_encode_fast_order(state, base, low, buffer_in, size_in,
+	    buffer_out, size_out, block, order, step);
+}
+
+/*
+ * As lzm_encode_fast() with a second table keyed on all eight bytes, so long
+ * repeats are not pushed out by short ones sharing their first bytes.  A hit
+ * there is preferred, the short table catches the rest.  The two tables are
+ * the halves of last_ht.
+ */
+static inline __attribute__((always_inline)) unsigned int
+lzm_encode_dfast_out(
+    const struct lzm_state * const state,
+    const unsigned char * const base,
+    const unsigned char * const low,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out,
+    struct lzm_block * const block,
+    const unsigned int checked)
 {
 	const unsigned char * const end = buffer_in + size_in;
 	const unsigned char * const match_end = end - 7;
-	const unsigned char * const scan_end = match_end - 3;
-	const unsigned char * const out_limit = buffer_out + *size_out;
+	const unsigned char * const scan_end = match_end - 7;
+	const unsigned char * const out_limit =
+	    checked ? buffer_out + *size_out : NULL;
+	const unsigned int order = state->hash_order - 1;
+	struct ht_entry * const short_ht = state->last_ht;
+	struct ht_entry * const long_ht = state->last_ht + (1 << order);
+	const unsigned char *lit_start = block->lit_start;
 	const unsigned char *curr_in = buffer_in;
-	const unsigned char *next_curr;
-	const unsigned char *curr_o;
 	const unsigned char *last;
-	const unsigned char *last_o;
-	const unsigned char *match_last;
-	const unsigned char *match_curr;
-	const unsigned char *next_last;
+	const unsigned char *short_last;
+	const unsigned char *long_last;
 	unsigned char *curr_out = buffer_out;
-	struct ht_entry *last_htp;
-	unsigned int token;
-	unsigned int next_token;
-	unsigned int last_token;
+	struct ht_entry *short_htp;
+	struct ht_entry *long_htp;
+	unsigned long int token;
+	unsigned int short_token;
+	unsigned int long_token;
+	unsigned int long_len;
 	unsigned int len;
 	unsigned int off;
-	unsigned int val;
-	unsigned int match_len;
-	unsigned int match_val;
-	unsigned int curr_chain;
-	unsigned int index;
 	unsigned int misses = (1 << MISS_ORDER) + 1;
-	unsigned int hashval;
-	unsigned int next_hashval;
+	const unsigned int max_off = offset_limit(state->format);
+	unsigned int reps[REP_COUNT];
+	unsigned int * const rep =
+	    (state->format == LZM_FORMAT_2) ? reps : NULL;
 
-	struct prev_match prev;
+	memcpy(reps, block->rep, sizeof(reps));
 
-	lzm_reset(state, buffer_in);
+	while (likely(curr_in < scan_end)) {
+		token = readmem64(curr_in);
+		short_htp = &short_ht[hash_lazy(token, order)];
+		long_htp = &long_ht[hash_long(token, order)];
+		short_last = short_htp->index + base;
+		short_token = short_htp->token;
+		last = long_htp->index + base;
+		long_token = long_htp->token;
+		short_htp->index = curr_in - base;
+		short_htp->token = token;
+		long_htp->index = curr_in - base;
+		long_htp->token = token >> 32;
+
+		if (long_token == (unsigned int)(token >> 32) && last >= low &&
+		    ((unsigned int)(curr_in - last) - 1) < max_off &&
+		    readmem64(last) == token) {
+			len = 8 + matchlen(curr_in + 8, last + 8, match_end);
+		} else if (rep != NULL &&
+		    rep[0] <= (unsigned int)(curr_in - low) &&
+		    (unsigned int)token == readmem32(curr_in - rep[0])) {
+			last = curr_in - rep[0];
+			len = MIN_MATCH + matchlen(curr_in + MIN_MATCH,
+			    last + MIN_MATCH, match_end);
+		} else if ((unsigned int)token == short_token &&
+		    short_last >= low &&
+		    ((unsigned int)(curr_in - short_last) - 1) < max_off) {
+			last = short_last;
+			len = MIN_MATCH + matchlen(curr_in + MIN_MATCH,
+			    last + MIN_MATCH, match_end);
+
+			/* A long match starting at the next byte wins */
+			token = readmem64(curr_in + 1);
+			long_htp = &long_ht[hash_long(token, order)];
+			long_last = long_htp->index + base;
+			if (long_htp->token == (unsigned int)(token >> 32) &&
+			    long_last >= low &&
+			    ((unsigned int)(curr_in + 1 - long_last) - 1) <
+			    max_off && readmem64(long_last) == token) {
+				long_len = 8 + matchlen(curr_in + 9,
+				    long_last + 8, match_end);
+				if (long_len > len) {
+					long_htp->index = curr_in + 1 - base;
+					long_htp->token = token >> 32;
+					curr_in++;
+					last = long_last;
+					len = long_len;
+				}
+			}
+		} else {
+			misses++;
+			curr_in += misses >> MISS_ORDER;
+			continue;
+		}
+		misses = (1 << MISS_ORDER) + 1;
 
-	prev.lit_start = buffer_in;
-	prev.start = 0;
-	prev.last = 0;
-	prev.length = 0;
+		off = matchlen_rev(curr_in, last, lit_start, low);
+		curr_in -= off;
+		last -= off;
+		len += off;
 
-	token = readmem32(curr_in);
-	hashval = hash_high(token, state->hash_order);
-	next_token = readmem32(curr_in + 1);
-	next_hashval = hash_high(next_token, state->hash_order);
-	last_htp = &state->last_ht[hashval];
-	index = curr_in - buffer_in;
-	state->chains[index & state->chain_mask] = *last_htp;
-	last_htp->index = index;
-	last_htp->token = token;
-	curr_in++;
+		curr_out = output_match(curr_out, lit_start,
+		    curr_in - lit_start, curr_in - last, len, out_limit, rep);
+		if (unlikely(curr_out == NULL))
+			return EOVERFLOW;
 
-	while (likely(curr_in < scan_end)) {
-		token = next_token;
-		hashval = next_hashval;
-		next_curr = curr_in + (misses >> MISS_ORDER);
-		next_token = readmem32(next_curr);
-		next_hashval = hash_high(next_token, state->hash_order);
-		last_htp = &state->last_ht[hashval];
-		last = last_htp->index + buffer_in;
-		last_token = last_htp->token;
-		index = curr_in - buffer_in;
-		state->chains[index & state->chain_mask] = *last_htp;
-		last_htp->index = index;
-		last_htp->token = token;
+		curr_in += len;
+		lit_start = curr_in;
 
-		match_val = 0;
-		match_len = 0;
-		match_last = NULL;
-		curr_chain = 1;
+		/* Index a position inside the match and the one before the end */
+		token = readmem64(curr_in - len + 2);
+		long_htp = &long_ht[hash_long(token, order)];
+		long_htp->index = curr_in - len + 2 - base;
+		long_htp->token = token >> 32;
+		token = readmem64(curr_in - 2);
+		short_htp = &short_ht[hash_lazy(token, order)];
+		short_htp->index = curr_in - 2 - base;
+		short_htp->token = token;
+		long_htp = &long_ht[hash_long(token, order)];
+		long_htp->index = curr_in - 2 - base;
+		long_htp->token = token >> 32;
+	}
 
-		for (;;) {
-			if ((curr_in - last) & ~MAX_OFFSET_MASK)
-				break;
+	curr_out = output_block_end(block, curr_out, lit_start, end,
+	    out_limit, rep);
+	if (curr_out == NULL)
+		return EOVERFLOW;
 
-			if ((token == last_token) && (match_len == 0 ||
-			    curr_in[match_len] == last[match_len])) {
+	*size_out = curr_out - buffer_out;
+	return 0;
+}
 
-				len = MIN_MATCH;
+static unsigned int
+lzm_encode_dfast(
+    const struct lzm_state * const state,
+    const unsigned char * const base,
+    const unsigned char * const low,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out,
+    struct lzm_block * const block)
+{
+	if (lzm_output_bounded(buffer_in, size_in, *size_out, block))
+		return lzm_encode_dfast_out(state, base, low, buffer_in,
+		    size_in, buffer_out, size_out, block, false);
+
+	return lzm_encode_dfast_out(state, base, low, buffer_in, size_in,
+	    buffer_out, size_out, block, true);
+}
+
+/*
+ * Runs repeating every 1, 2, 4 or 8 bytes, such as zero filled pages, found
+ * without a table lookup.  Returns the length of the match at curr_in +
+ * *period against curr_in when it reaches RUN_MIN, otherwise 0.  Runs of
+ * other periods are left to the match finders.
+ */
+static inline unsigned int
+lzm_run_find(const unsigned char * const curr_in,
+    const unsigned char * const match_end, unsigned int * const period)
+{
+	const unsigned long val = readmem64(curr_in);
+	unsigned int len;
+
+	if (curr_in + 16 > match_end || val != readmem64(curr_in + 8))
+		return 0;
+
+	if (val == (val & 0xFF) * 0x0101010101010101UL)
+		*period = 1;
+	else if (val == (val & 0xFFFF) * 0x0001000100010001UL)
+		*period = 2;
+	else if ((val >> 32) == (val & 0xFFFFFFFF))
+		*period = 4;
+	else
+		*period = 8;
+
+	len = matchlen(curr_in + *period, curr_in, match_end);
+	if (len < RUN_MIN)
+		return 0;
+
+	return len;
+}
+
+static inline unsigned int
+lzm_offset_cost(const unsigned int length)
+{
+	return offmap[__builtin_clz(length | !length)].bytes;
+}
+
+typedef unsigned int (*lzm_find_func)(const struct lzm_state * const,
+    const unsigned char * const, const unsigned char * const,
+    const unsigned char * const, const unsigned char * const,
+    const unsigned char ** const);
+
+static inline unsigned int
+lzm_lazy_find(const struct lzm_state * const state,
+    const unsigned char * const base, const unsigned char * const low,
+    const unsigned char * const curr_in, const unsigned char * const match_end,
+    const unsigned char ** const last)
+{
+	const unsigned long token = readmem64(curr_in);
+	struct ht_entry * const last_htp =
+	    &state->last_ht[hash_lazy(token, state->hash_order)];
+	const unsigned int last_token = last_htp->token;
+
+	*last = last_htp->index + base;
+	last_htp->index = curr_in - base;
+	last_htp->token = token;
+
+	if ((unsigned int)token != last_token || *last < low ||
+	    ((unsigned int)(curr_in - *last) - 1) >=
+	    offset_limit(state->format))
+		return 0;
+
+	return MIN_MATCH + matchlen(curr_in + MIN_MATCH, *last + MIN_MATCH,
+	    match_end);
+}
+
+/*
+ * As lzm_lazy_find() but probing a whole bucket, the match worth the most
+ * after its offset cost is returned.
+ */
+static inline unsigned int
+lzm_bucket_find(const struct lzm_state * const state,
+    const unsigned char * const base, const unsigned char * const low,
+    const unsigned char * const curr_in, const unsigned char * const match_end,
+    const unsigned char ** const last)
+{
+	const unsigned long token = readmem64(curr_in);
+	struct ht_entry * const bucket = &state->last_ht[hash_lazy(token,
+	    state->hash_order - BUCKET_ORDER) << BUCKET_ORDER];
+	const unsigned char *cand;
+	const unsigned int max_off = offset_limit(state->format);
+	unsigned int mask = bucket_find(bucket, token);
+	unsigned int best = 0;
+	unsigned int len;
+	unsigned int val;
+	unsigned int best_val = 0;
+
+	while (mask != 0) {
+		cand = bucket[__builtin_ctz(mask)].index + base;
+		mask &= mask - 1;
+		if (cand < low ||
+		    ((unsigned int)(curr_in - cand) - 1) >= max_off)
+			continue;
+		len = MIN_MATCH + matchlen(curr_in + MIN_MATCH,
+		    cand + MIN_MATCH, match_end);
+		val = len - lzm_offset_cost(curr_in - cand);
+		if (val > best_val) {
+			best = len;
+			best_val = val;
+			*last = cand;
+		}
+	}
+
+	bucket_insert(bucket, curr_in - base, token);
+
+	return best;
+}
+
+/*
+ * Lazy matching, find() probes the hash table for one position.  Before a
+ * match is committed the following positions (up to chain_length of them)
+ * are probed as well and a better match there replaces it.
+ */
+static inline __attribute__((always_inline)) unsigned int
+lzm_encode_lazy_find(
+    const struct lzm_state * const state,
+    const unsigned char * const base,
+    const unsigned char * const low,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out,
+    struct lzm_block * const block,
+    const lzm_find_func find)
+{
+	const unsigned char * const end = buffer_in + size_in;
+	const unsigned char * const match_end = end - 7;
+	const unsigned char * const scan_end = match_end - 7;
+	const unsigned char * const out_limit = buffer_out + *size_out;
+	const unsigned char *lit_start = block->lit_start;
+	const unsigned char *curr_in = buffer_in;
+	const unsigned char *last;
+	const unsigned char *next_last;
+	unsigned char *curr_out = buffer_out;
+	unsigned int len;
+	unsigned int val;
+	unsigned int next_len;
+	unsigned int next_val;
+	unsigned int depth;
+	unsigned int off;
+	unsigned int misses = (1 << MISS_ORDER) + 1;
+	unsigned int reps[REP_COUNT];
+	unsigned int * const rep =
+	    (state->format == LZM_FORMAT_2) ? reps : NULL;
+
+	memcpy(reps, block->rep, sizeof(reps));
+
+	while (likely(curr_in < scan_end)) {
+		len = find(state, base, low, curr_in, match_end,
+		    &last);
+		val = (len == 0) ? 0 : len - lzm_offset_cost(curr_in - last);
+		if (rep != NULL) {
+			next_len = lzm_rep_find(low, curr_in, match_end,
+			    rep, &off);
+			if (next_len > 0 && next_len - 1 > val) {
+				len = next_len;
+				val = next_len - 1;
+				last = curr_in - off;
+			}
+		}
+		if (len == 0) {
+			misses++;
+			curr_in += misses >> MISS_ORDER;
+			continue;
+		}
+		misses = (1 << MISS_ORDER) + 1;
+
+		for (depth = state->chain_length; depth > 0; depth--) {
+			if ((curr_in + 1) >= scan_end)
+				break;
+			next_len = find(state, base, low, curr_in + 1,
+			    match_end, &next_last);
+			if (next_len == 0)
+				break;
+			next_val = next_len -
+			    lzm_offset_cost(curr_in + 1 - next_last);
+			if (next_val <= val)
+				break;
+			curr_in++;
+			last = next_last;
+			len = next_len;
+			val = next_val;
+		}
+
+		off = matchlen_rev(curr_in, last, lit_start, low);
+		curr_in -= off;
+		last -= off;
+		len += off;
+
+		curr_out = output_match(curr_out, lit_start,
+		    curr_in - lit_start, curr_in - last, len, out_limit, rep);
+		if (unlikely(curr_out == NULL))
+			return EOVERFLOW;
+
+		curr_in += len;
+		lit_start = curr_in;
+
+		if (likely(curr_in < scan_end))
+			find(state, base, low, curr_in - 2, match_end,
+			    &next_last);
+	}
+
+	curr_out = output_block_end(block, curr_out, lit_start, end,
+	    out_limit, rep);
+	if (curr_out == NULL)
+		return EOVERFLOW;
+
+	*size_out = curr_out - buffer_out;
+	return 0;
+}
+
+/*
+ * Lazy matching with a single probe hash table.
+ */
+static unsigned int
+lzm_encode_lazy(
+    const struct lzm_state * const state,
+    const unsigned char * const base,
+    const unsigned char * const low,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out,
+    struct lzm_block * const block)
+{
+	return lzm_encode_lazy_find(state, base, low, buffer_in, size_in,
+	    buffer_out, size_out, block, lzm_lazy_find);
+}
+
+/*
+ * Lazy matching over set associative buckets, see lzm_bucket_find().
+ */
+static unsigned int
+lzm_encode_bucket(
+    const struct lzm_state * const state,
+    const unsigned char * const base,
+    const unsigned char * const low,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out,
+    struct lzm_block * const block)
+{
+	return lzm_encode_lazy_find(state, base, low, buffer_in, size_in,
+	    buffer_out, size_out, block, lzm_bucket_find);
+}
+
+static unsigned int
+lzm_encode_high(
+    const struct lzm_state * const state,
+    const unsigned char * const base,
+    const unsigned char * const low,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out,
+    struct lzm_block * const block)
+{
+	const unsigned char * const end = buffer_in + size_in;
+	const unsigned char * const match_end = end - 7;
+	const unsigned char * const scan_end = match_end - 3;
+	const unsigned char * const out_limit = buffer_out + *size_out;
+	const unsigned char *curr_in = buffer_in;
+	const unsigned char *next_curr;
+	const unsigned char *curr_o;
+	const unsigned char *last;
+	const unsigned char *last_o;
+	const unsigned char *match_last;
+	const unsigned char *match_curr;
+	const unsigned char *next_last;
+	const unsigned char *ahead;
+	unsigned char *curr_out = buffer_out;
+	struct ht_entry *last_htp;
+	unsigned int *next_link;
+	unsigned int token;
+	unsigned int next_token;
+	unsigned int last_token;
+	unsigned int len;
+	unsigned int off;
+	unsigned int val;
+	unsigned int match_len;
+	unsigned int match_val;
+	unsigned int curr_chain;
+	unsigned int index;
+	unsigned int misses = (1 << MISS_ORDER) + 1;
+	unsigned int hashval;
+	unsigned int next_hashval;
+	const unsigned int max_off = offset_limit(state->format);
+	unsigned int reps[REP_COUNT];
+	unsigned int pending[REP_COUNT];
+
+	struct prev_match prev;
+
+	prev.lit_start = block->lit_start;
+	prev.start = 0;
+	prev.last = 0;
+	prev.rep = (state->format == LZM_FORMAT_2) ? reps : NULL;
+	prev.length = 0;
+
+	memcpy(reps, block->rep, sizeof(reps));
+
+	token = readmem32(curr_in);
+	hashval = hash_high(token, state->hash_order);
+	next_token = readmem32(curr_in + 1);
+	next_hashval = hash_high(next_token, state->hash_order);
+	last_htp = &state->last_ht[hashval];
+	index = curr_in - base;
+	state->chains[index & state->chain_mask] = last_htp->index;
+	last_htp->index = index;
+	last_htp->token = token;
+	curr_in++;
+
+	while (likely(curr_in < scan_end)) {
+		token = next_token;
+		hashval = next_hashval;
+		next_curr = curr_in + (misses >> MISS_ORDER);
+		next_token = readmem32(next_curr);
+		next_hashval = hash_high(next_token, state->hash_order);
+		if (state->prefetch)
+			__builtin_prefetch(&state->last_ht[next_hashval]);
+		last_htp = &state->last_ht[hashval];
+		last = last_htp->index + base;
+		last_token = last_htp->token;
+		index = curr_in - base;
+		state->chains[index & state->chain_mask] = last_htp->index;
+		last_htp->index = index;
+		last_htp->token = token;
+
+		match_val = 0;
+		match_len = 0;
+		match_last = NULL;
+		curr_chain = 1;
+
+		/* Runs are taken as they are, without walking the chains */
+		len = lzm_run_find(curr_in, match_end, &off);
+		if (len != 0) {
+			curr_o = curr_in + off;
+			val = matchlen_rev(curr_o, curr_in, prev.lit_start, low);
+			match_len = len + val;
+			match_curr = curr_o - val;
+			match_last = match_curr - off;
+			goto found;
+		}
+
+		if (prev.rep != NULL) {
+			len = lzm_rep_find(low, curr_in, match_end,
+			    lzm_rep_pending(&prev, pending), &off);
+			if (len > 0) {
+				last_o = curr_in - off;
+				off = matchlen_rev(curr_in, last_o,
+				    prev.lit_start, low);
+				match_len = len + off;
+				match_val = match_len - 1;
+				match_last = last_o - off;
+				match_curr = curr_in - off;
+			}
+		}
+
+		for (;;) {
+			if (last < low ||
+			    (unsigned int)(curr_in - last) > max_off)
+				break;
+
+			/* Fetch the next link while this candidate is checked */
+			next_link = &state->chains[(last - base) &
+			    state->chain_mask];
+			__builtin_prefetch(next_link);
+
+			if ((token == last_token) && (match_len == 0 ||
+			    curr_in[match_len] == last[match_len])) {
+
+				len = MIN_MATCH;
 				len += matchlen(curr_in + len, last + len,
 				    match_end);
 				off = matchlen_rev(curr_in, last,
-				    prev.lit_start, buffer_in);
+				    prev.lit_start, low);
 				curr_o = curr_in - off;
 				last_o = last - off;
 				len += off;
@@ -663,23 +1586,23 @@ lzm_encode_high(
 					match_len = len;
 					match_last = last_o;
 					match_curr = curr_o;
-					if ((curr_o + len) >= scan_end)
+					if ((curr_o + len) >= scan_end ||
+					    (len >= RUN_MIN &&
+					    (curr_o - last_o) <= RUN_PERIOD))
 						break;
 				}
 			}
 
-			if (curr_chain++ == MAX_CHAIN_LENGTH)
+			if (curr_chain++ == state->chain_length)
 				break;
 
-			index = last - buffer_in;
-			last_htp = &state->chains[index & state->chain_mask];
-			next_last = last_htp->index + buffer_in;
-			last_token = last_htp->token;
-
-			if (next_last >= last)
+			next_last = *next_link + base;
+			if (next_last >= last || next_last < low)
 				break;
 
+			/* Links carry no token, it is read from the input */
 			last = next_last;
+			last_token = readmem32(last);
 		}
 
 		if (match_len == 0) {
@@ -687,6 +1610,7 @@ lzm_encode_high(
 			curr_in = next_curr;
 			continue;
 		}
+ found:
 		misses = (1 << MISS_ORDER) + 1;
 
 		curr_out = output_match_merge(&prev, curr_out, match_curr,
@@ -694,12 +1618,36 @@ lzm_encode_high(
 		if (unlikely(curr_out == NULL))
 			return EOVERFLOW;
 
+		off = match_curr - match_last;
 		match_curr += match_len;
 		if (match_curr >= scan_end)
 			break;
 
+		/* The body of a run all hashes alike, it is not inserted */
+		if (off <= RUN_PERIOD && match_len >= RUN_MIN) {
+			curr_in = match_curr;
+			next_token = readmem32(curr_in);
+			next_hashval = hash_high(next_token, state->hash_order);
+			continue;
+		}
+
+		/*
+		 * Positions covered by the match are only inserted.  With a
+		 * table that misses the cache hash PREFETCH_DIST of them ahead,
+		 * so their lines are loaded by the time they are updated.
+		 */
 		curr_in = next_curr;
+		ahead = state->prefetch ? curr_in + 1 : match_curr + 1;
+		for (; ahead < match_curr && ahead < curr_in + PREFETCH_DIST;
+		    ahead++)
+			__builtin_prefetch(&state->last_ht[hash_high(
+			    readmem32(ahead), state->hash_order)]);
 		while (curr_in < match_curr) {
+			if (ahead <= match_curr) {
+				__builtin_prefetch(&state->last_ht[hash_high(
+				    readmem32(ahead), state->hash_order)]);
+				ahead++;
+			}
 			token = next_token;
 			hashval = next_hashval;
 			next_curr = curr_in + (misses >> MISS_ORDER);
@@ -707,15 +1655,16 @@ lzm_encode_high(
 			next_hashval = hash_high(next_token,
 			    state->hash_order);
 			last_htp = &state->last_ht[hashval];
-			index = curr_in - buffer_in;
-			state->chains[index & state->chain_mask] = *last_htp;
+			index = curr_in - base;
+			state->chains[index & state->chain_mask] = last_htp->index;
 			last_htp->index = index;
 			last_htp->token = token;
 			curr_in = next_curr;
 		}
 	}
 
-	curr_out = output_match_final(&prev, curr_out, end, out_limit);
+	curr_out = output_match_final(&prev, curr_out, end, out_limit,
+	    block);
 	if (curr_out == NULL)
 		return EOVERFLOW;
 
@@ -723,95 +1672,1295 @@ lzm_encode_high(
 	return 0;
 }
 
-typedef unsigned int (*lzm_codec_func)(
-    const struct lzm_state * const state,
-    const unsigned char * const buffer_in,
-    const unsigned int size_in,
-    unsigned char * const buffer_out,
-    unsigned int * const size_out);
+/*
+ * Binary tree match finder.  Each hash bucket heads a binary search tree of
+ * the positions that hashed to it, ordered by the bytes that follow them.
+ * A lookup walks a single path down the tree while re-rooting it at the
+ * current position, so a position costs O(log n) node visits instead of a
+ * full chain walk.  Comparisons stop at BT_NICE bytes, at which point the
+ * node found is replaced by the current position.
+ */
+static inline unsigned int
+lzm_bt_matches(const struct lzm_state * const state,
+    const unsigned char * const base, const unsigned char * const low,
+    const unsigned char * const curr_in, const unsigned char * const match_end,
+    struct opt_match * const matches)
+{
+	const unsigned int window = state->chain_mask + 1;
+	const unsigned int span = MIN(state->chain_mask, curr_in - low);
+	const unsigned int index = curr_in - base;
+	const unsigned int limit = MIN(match_end - curr_in, BT_NICE);
+	const unsigned int token = readmem32(curr_in);
+	const unsigned int max_off = offset_limit(state->format);
+	struct ht_entry * const last_htp =
+	    &state->last_ht[hash_high(token, state->hash_order)];
+	struct bt_node *node = &state->tree[index & state->chain_mask];
+	const unsigned char *last;
+	unsigned int *smaller = &node->child[0];
+	unsigned int *larger = &node->child[1];
+	unsigned int depth = state->chain_length;
+	const unsigned int cand_token = last_htp->token;
+	unsigned int cand = last_htp->index;
+	unsigned int best = MIN_MATCH - 1;
+	unsigned int count = 0;
+	unsigned int len_smaller = 0;
+	unsigned int len_larger = 0;
+	unsigned int delta;
+	unsigned int len;
 
-struct lzm_config {
-	lzm_codec_func	codec;
-	unsigned int	hash_order;
-	unsigned int	chain_order;
-};
+	/*
+	 * Near the end of the input comparisons would be cut short and leave
+	 * the tree out of order for data that follows in stream mode, so the
+	 * last positions only check the head of the bucket and are not added.
+	 */
+	if (limit < BT_NICE) {
+		delta = index - cand;
+		if (token != cand_token || (delta - 1) >= max_off ||
+		    delta > (unsigned int)(curr_in - low))
+			return 0;
+		last = base + cand;
+		matches[0].len = MIN_MATCH + matchlen(curr_in + MIN_MATCH,
+		    last + MIN_MATCH, curr_in + limit);
+		matches[0].off = delta;
+		return 1;
+	}
 
-__attribute__((aligned(64)))
-struct lzm_config lzm_encode_config[LZM_LEVEL_COUNT] = {
-	{ lzm_encode_none, 		 0,  0 },
-	{ lzm_encode_fast, HASH_ORDER_FAST,  0 },
-	{ lzm_encode_high, HASH_ORDER_MID,   4 },
-	{ lzm_encode_high, HASH_ORDER_HIGH,  8 },
-	{ lzm_encode_high, HASH_ORDER_HIGH, 12 },
-	{ lzm_encode_high, HASH_ORDER_HIGH, 16 },
-	{ lzm_encode_high, HASH_ORDER_HIGH, 20 },
-	{ lzm_encode_high, HASH_ORDER_HIGH, 24 },
-};
+	last_htp->index = index;
+	last_htp->token = token;
 
-static int
-lzm_malloc(void **addr, unsigned int size)
-{
-	int error;
+	/*
+	 * The tree only covers the window but, as with the hash chains, the
+	 * head of the bucket is still a usable candidate beyond it.
+	 */
+	delta = index - cand;
+	if (delta >= window && delta <= max_off &&
+	    delta <= (unsigned int)(curr_in - low)) {
+		*smaller = *larger = index - window;
+		if (token != cand_token)
+			return 0;
+		last = base + cand;
+		matches[0].len = MIN_MATCH + matchlen(curr_in + MIN_MATCH,
+		    last + MIN_MATCH, curr_in + limit);
+		matches[0].off = delta;
+		return 1;
+	}
 
-	error = posix_memalign(addr, MEM_ALIGN, size);
-	if (error != 0)
-		error = ENOMEM;
+	for (;;) {
+		delta = index - cand;
+		if ((delta - 1) >= span || depth-- == 0) {
+			*smaller = *larger = index - window;
+			break;
+		}
 
-	return error;
+		node = &state->tree[cand & state->chain_mask];
+		last = base + cand;
+		len = MIN(len_smaller, len_larger);
+
+		if (last[len] == curr_in[len]) {
+			len++;
+			len += matchlen(curr_in + len, last + len,
+			    curr_in + limit);
+			if (len > best) {
+				best = len;
+				if (len >= MIN_MATCH) {
+					matches[count].len = len;
+					matches[count].off = delta;
+					count++;
+				}
+			}
+			if (len == limit) {
+				*smaller = node->child[0];
+				*larger = node->child[1];
+				break;
+			}
+		}
+
+		if (last[len] < curr_in[len]) {
+			*smaller = cand;
+			smaller = &node->child[1];
+			cand = *smaller;
+			len_smaller = len;
+		} else {
+			*larger = cand;
+			larger = &node->child[0];
+			cand = *larger;
+			len_larger = len;
+		}
+	}
+
+	return count;
 }
 
-unsigned int
-lzm_encode_init(struct lzm_state ** const state, const unsigned int format,
+/*
+ * Pick the candidate with the best length to offset cost trade off.  The
+ * longest candidate is extended past BT_NICE first.
+ */
+static inline unsigned int
+lzm_bt_best(const unsigned char * const curr_in,
+    const unsigned char * const match_end, struct opt_match * const matches,
+    const unsigned int nmatches, struct opt_match * const best)
+{
+	struct opt_match * const longest = &matches[nmatches - 1];
+	unsigned int best_val = 0;
+	unsigned int val;
+	unsigned int i;
+
+	if (longest->len == BT_NICE) {
+		longest->len += matchlen(curr_in + BT_NICE,
+		    curr_in - longest->off + BT_NICE, match_end);
+	}
+
+	*best = *longest;
+	for (i = nmatches; i-- > 0; ) {
+		val = matches[i].len - lzm_offset_cost(matches[i].off);
+		if (val > best_val) {
+			best_val = val;
+			*best = matches[i];
+		}
+	}
+
+	return best_val;
+}
+
+/*
+ * Greedy parse on top of the binary tree match finder.  Every position has
+ * to be inserted into the tree anyway, so the one following a match is
+ * searched first and a better match there is taken instead (lazy matching).
+ */
+static unsigned int
+lzm_encode_bt(
+    const struct lzm_state * const state,
+    const unsigned char * const base,
+    const unsigned char * const low,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out,
+    struct lzm_block * const block)
+{
+	const unsigned char * const end = buffer_in + size_in;
+	const unsigned char * const match_end = end - 7;
+	const unsigned char * const scan_end = match_end - 3;
+	const unsigned char * const out_limit = buffer_out + *size_out;
+	const unsigned char *curr_in = buffer_in;
+	const unsigned char *match_curr;
+	const unsigned char *match_last;
+	unsigned char *curr_out = buffer_out;
+	struct opt_match matches[BT_NICE];
+	struct opt_match match;
+	struct opt_match next;
+	unsigned int nmatches;
+	unsigned int match_len;
+	unsigned int match_val;
+	unsigned int next_val;
+	unsigned int off;
+	unsigned int misses = (1 << MISS_ORDER) + 1;
+	unsigned int reps[REP_COUNT];
+	unsigned int pending[REP_COUNT];
+
+	struct prev_match prev;
+
+	prev.lit_start = block->lit_start;
+	prev.start = 0;
+	prev.last = 0;
+	prev.rep = (state->format == LZM_FORMAT_2) ? reps : NULL;
+	prev.length = 0;
+
+	memcpy(reps, block->rep, sizeof(reps));
+
+	while (likely(curr_in < scan_end)) {
+		nmatches = lzm_bt_matches(state, base, low, curr_in,
+		    match_end, matches);
+		match_val = 0;
+		if (nmatches != 0)
+			match_val = lzm_bt_best(curr_in, match_end, matches,
+			    nmatches, &match);
+
+		if (prev.rep != NULL) {
+			next.len = lzm_rep_find(low, curr_in, match_end,
+			    lzm_rep_pending(&prev, pending), &next.off);
+			if (next.len > 0 && next.len - 1 > match_val) {
+				match = next;
+				match_val = next.len - 1;
+			}
+		}
+
+		if (match_val == 0) {
+			misses++;
+			curr_in += misses >> MISS_ORDER;
+			continue;
+		}
+		misses = (1 << MISS_ORDER) + 1;
+
+		while ((curr_in + 1) < scan_end) {
+			nmatches = lzm_bt_matches(state, base, low,
+			    curr_in + 1, match_end, matches);
+			if (nmatches == 0)
+				break;
+			next_val = lzm_bt_best(curr_in + 1, match_end,
+			    matches, nmatches, &next);
+			if (next_val <= match_val + 1)
+				break;
+			match = next;
+			match_val = next_val;
+			curr_in++;
+		}
+
+		match_last = curr_in - match.off;
+		off = matchlen_rev(curr_in, match_last, prev.lit_start,
+		    low);
+		match_curr = curr_in - off;
+		match_last -= off;
+		match_len = match.len + off;
+
+		curr_out = output_match_merge(&prev, curr_out, match_curr,
+		    match_last, match_len, out_limit);
+		if (unlikely(curr_out == NULL))
+			return EOVERFLOW;
+
+		match_curr += match_len;
+		if (match_curr >= scan_end)
+			break;
+
+		curr_in++;
+		while (++curr_in < match_curr)
+			lzm_bt_matches(state, base, low, curr_in, match_end,
+			    matches);
+	}
+
+	curr_out = output_match_final(&prev, curr_out, end, out_limit,
+	    block);
+	if (curr_out == NULL)
+		return EOVERFLOW;
+
+	*size_out = curr_out - buffer_out;
+	return 0;
+}
+
+/*
+ * Exact cost in bytes of an output_length() escape.
+ */
+static inline unsigned int
+lzm_length_cost(const unsigned int length)
+{
+	if (likely(length < 252))
+		return 1;
+	if (likely(length < (256+252)))
+		return 2;
+	if (likely(length < (65536+253)))
+		return 3;
+	if (likely(length < (16777216+254)))
+		return 4;
+	return 5;
+}
+
+/*
+ * Cost of a pending literal run, including its length escape.
+ */
+static inline unsigned int
+lzm_literal_cost(const unsigned int litlen)
+{
+	if (likely(litlen < 15))
+		return litlen;
+
+	return litlen + lzm_length_cost(litlen - 15);
+}
+
+/*
+ * Cost of closing a sequence with a match: op byte, offset and length escape.
+ */
+static inline unsigned int
+lzm_match_cost(const unsigned int offset, const unsigned int length)
+{
+	const unsigned int mlen = length - MIN_MATCH;
+	unsigned int cost = 1 + lzm_offset_cost(offset);
+
+	if (unlikely(mlen >= 15))
+		cost += lzm_length_cost(mlen - 15);
+
+	return cost;
+}
+
+/*
+ * Prices used by the optimal parser, in 1/(1 << OPT_COST_SHIFT) bytes.  With
+ * dspeed they add the decoder time of tokens that miss its fast path: the
+ * dispatch every sequence pays, literal runs needing a length escape, short
+ * offsets overlapping the match, which are copied a few bytes at a time, and
+ * long match lengths.
+ */
+static inline unsigned int
+lzm_literal_price(const unsigned int litlen, const unsigned int dspeed)
+{
+	unsigned int price = lzm_literal_cost(litlen) << OPT_COST_SHIFT;
+
+	if (dspeed && litlen >= 15)
+		price += DEC_COST_LITERAL;
+
+	return price;
+}
+
+static inline unsigned int
+lzm_match_price(const unsigned int offset, const unsigned int length,
+    const unsigned int dspeed)
+{
+	unsigned int price = lzm_match_cost(offset, length) << OPT_COST_SHIFT;
+
+	if (dspeed) {
+		price += DEC_COST_TOKEN;
+		if (offset < 8 && offset < length)
+			price += DEC_COST_OVERLAP +
+			    length * DEC_COST_OVERLAP_BYTE;
+		if (length >= 15 + MIN_MATCH)
+			price += DEC_COST_LONG;
+	}
+
+	return price;
+}
+
+/*
+ * Insert the position into the hash chains and collect every match that is
+ * longer than the ones found before it.  Chains are walked from the most
+ * recent position so each length is paired with its smallest offset.
+ */
+static inline unsigned int
+lzm_opt_matches(const struct lzm_state * const state,
+    const unsigned char * const base, const unsigned char * const low,
+    const unsigned char * const curr_in, const unsigned char * const match_end,
+    struct opt_match * const matches)
+{
+	const unsigned char *last;
+	const unsigned char *next_last;
+	struct ht_entry *last_htp;
+	const unsigned int token = readmem32(curr_in);
+	const unsigned int index = curr_in - base;
+	const unsigned int max_off = offset_limit(state->format);
+	unsigned int last_token;
+	unsigned int curr_chain = 1;
+	unsigned int best = MIN_MATCH - 1;
+	unsigned int count = 0;
+	unsigned int len;
+
+	last_htp = &state->last_ht[hash_high(token, state->hash_order)];
+	last = last_htp->index + base;
+	last_token = last_htp->token;
+	state->chains[index & state->chain_mask] = last_htp->index;
+	last_htp->index = index;
+	last_htp->token = token;
+
+	while (last < curr_in) {
+		if (last < low || (unsigned int)(curr_in - last) > max_off)
+			break;
+
+		if (token == last_token && curr_in[best] == last[best]) {
+			len = MIN_MATCH;
+			len += matchlen(curr_in + len, last + len, match_end);
+			if (len > best) {
+				matches[count].len = len;
+				matches[count].off = curr_in - last;
+				count++;
+				best = len;
+				if (len >= OPT_NICE ||
+				    (curr_in + len) >= match_end)
+					break;
+			}
+		}
+
+		if (curr_chain++ == state->chain_length)
+			break;
+
+		next_last = state->chains[(last - base) & state->chain_mask] +
+		    base;
+		if (next_last >= last || next_last < low)
+			break;
+
+		last = next_last;
+		last_token = readmem32(last);
+	}
+
+	return count;
+}
+
+static inline void
+lzm_opt_insert(const struct lzm_state * const state,
+    const unsigned char * const base, const unsigned char *curr_in,
+    const unsigned char * const limit)
+{
+	struct ht_entry *last_htp;
+	unsigned int token;
+	unsigned int index;
+
+	while (curr_in < limit) {
+		token = readmem32(curr_in);
+		last_htp = &state->last_ht[hash_high(token, state->hash_order)];
+		index = curr_in - base;
+		state->chains[index & state->chain_mask] = last_htp->index;
+		last_htp->index = index;
+		last_htp->token = token;
+		curr_in++;
+	}
+}
+
+/*
+ * Price every match length reachable from node pos.  Shorter lengths use
+ * the smallest offset that still covers them.
+ */
+static inline void
+lzm_opt_relax(struct opt_node * const node, const unsigned int pos,
+    unsigned int * const last_pos, const struct opt_match * const matches,
+    const unsigned int nmatches, const unsigned int dspeed)
+{
+	const unsigned int base = node[pos].price;
+	unsigned int mlen = MIN_MATCH;
+	unsigned int price;
+	unsigned int i;
+	unsigned int j;
+
+	for (i = 0; i < nmatches; i++) {
+		for (; mlen <= matches[i].len; mlen++) {
+			j = pos + mlen;
+			while (*last_pos < j)
+				node[++(*last_pos)].price = ~0U;
+			price = base + lzm_match_price(matches[i].off, mlen,
+			    dspeed);
+			if (price < node[j].price) {
+				node[j].price = price;
+				node[j].litlen = 0;
+				node[j].mlen = mlen;
+				node[j].off = matches[i].off;
+			}
+		}
+	}
+}
+
+static inline void
+lzm_opt_literal(struct opt_node * const node, const unsigned int pos,
+    const unsigned int dspeed)
+{
+	const unsigned int litlen = node[pos - 1].litlen + 1;
+	const unsigned int price = node[pos - 1].price +
+	    lzm_literal_price(litlen, dspeed) -
+	    lzm_literal_price(litlen - 1, dspeed);
+
+	/*
+	 * On a tie keep extending a run that already paid for a length escape,
+	 * the run following the match would have to pay for it again.
+	 */
+	if (price < node[pos].price ||
+	    (price == node[pos].price && litlen > 15)) {
+		node[pos].price = price;
+		node[pos].litlen = litlen;
+		node[pos].mlen = 0;
+	}
+}
+
+/*
+ * Optimal parse.  Blocks of up to OPT_NUM positions are priced with a
+ * forward dynamic programming pass using the exact size of each token, then
+ * the cheapest path is walked back and emitted.  Matches of OPT_NICE bytes
+ * or more end the block early and are taken as is.  With dspeed the price
+ * also counts the time to decode each token.
+ */
+static inline __attribute__((always_inline)) unsigned int
+lzm_encode_opt_parse(
+    const struct lzm_state * const state,
+    const unsigned char * const base,
+    const unsigned char * const low,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out,
+    struct lzm_block * const block,
+    const unsigned int dspeed)
+{
+	const unsigned char * const end = buffer_in + size_in;
+	const unsigned char * const match_end = end - 7;
+	const unsigned char * const scan_end = match_end - 3;
+	const unsigned char * const out_limit = buffer_out + *size_out;
+	struct opt_node * const node = state->opt->node;
+	struct opt_seq * const seq = state->opt->seq;
+	const unsigned char *lit_start = block->lit_start;
+	const unsigned char *curr_in = buffer_in;
+	const unsigned char *start;
+	unsigned char *curr_out = buffer_out;
+	struct opt_match matches[OPT_NICE];
+	struct opt_match take;
+	unsigned int nmatches;
+	unsigned int last_pos;
+	unsigned int end_pos;
+	unsigned int nseq;
+	unsigned int mlen;
+	unsigned int pos;
+	unsigned int reps[REP_COUNT];
+	unsigned int * const rep =
+	    (state->format == LZM_FORMAT_2) ? reps : NULL;
+
+	memcpy(reps, block->rep, sizeof(reps));
+
+	while (likely(curr_in < scan_end)) {
+		nmatches = lzm_opt_matches(state, base, low, curr_in,
+		    match_end, matches);
+		if (nmatches == 0) {
+			curr_in++;
+			continue;
+		}
+
+		take = matches[nmatches - 1];
+		if (take.len >= OPT_NICE) {
+			curr_out = output_match(curr_out, lit_start,
+			    curr_in - lit_start, take.off, take.len, out_limit,
+			    rep);
+			if (unlikely(curr_out == NULL))
+				return EOVERFLOW;
+			lzm_opt_insert(state, base, curr_in + 1,
+			    curr_in + take.len);
+			curr_in += take.len;
+			lit_start = curr_in;
+			continue;
+		}
+
+		node[0].price = lzm_literal_price(curr_in - lit_start, dspeed);
+		node[0].litlen = curr_in - lit_start;
+		node[0].mlen = 0;
+		last_pos = 0;
+		lzm_opt_relax(node, 0, &last_pos, matches, nmatches, dspeed);
+
+		take.len = 0;
+		for (pos = 1; pos < last_pos; pos++) {
+			lzm_opt_literal(node, pos, dspeed);
+
+			if ((curr_in + pos) >= scan_end)
+				break;
+
+			nmatches = lzm_opt_matches(state, base, low,
+			    curr_in + pos, match_end, matches);
+			if (nmatches == 0)
+				continue;
+
+			take = matches[nmatches - 1];
+			if (take.len >= OPT_NICE ||
+			    (pos + take.len) > OPT_NUM)
+				break;
+			take.len = 0;
+
+			lzm_opt_relax(node, pos, &last_pos, matches, nmatches,
+			    dspeed);
+		}
+
+		if (pos == last_pos)
+			lzm_opt_literal(node, pos, dspeed);
+
+		/* Walk the cheapest path back from the end of the block */
+		end_pos = pos;
+		nseq = 0;
+		if (take.len != 0) {
+			end_pos += take.len;
+			lzm_opt_insert(state, base, curr_in + pos + 1,
+			    curr_in + end_pos);
+			seq[nseq].pos = pos;
+			seq[nseq].len = take.len;
+			seq[nseq].off = take.off;
+			nseq++;
+		}
+
+		while (pos > 0) {
+			mlen = node[pos].mlen;
+			if (mlen == 0) {
+				pos--;
+				continue;
+			}
+			pos -= mlen;
+			seq[nseq].pos = pos;
+			seq[nseq].len = mlen;
+			seq[nseq].off = node[pos + mlen].off;
+			nseq++;
+		}
+
+		while (nseq > 0) {
+			nseq--;
+			start = curr_in + seq[nseq].pos;
+			curr_out = output_match(curr_out, lit_start,
+			    start - lit_start, seq[nseq].off, seq[nseq].len,
+			    out_limit, rep);
+			if (unlikely(curr_out == NULL))
+				return EOVERFLOW;
+			lit_start = start + seq[nseq].len;
+		}
+
+		curr_in += end_pos;
+	}
+
+	curr_out = output_block_end(block, curr_out, lit_start, end,
+	    out_limit, rep);
+	if (curr_out == NULL)
+		return EOVERFLOW;
+
+	*size_out = curr_out - buffer_out;
+	return 0;
+}
+
+static unsigned int
+lzm_encode_opt(
+    const struct lzm_state * const state,
+    const unsigned char * const base,
+    const unsigned char * const low,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out,
+    struct lzm_block * const block)
+{
+	return lzm_encode_opt_parse(state, base, low, buffer_in, size_in,
+	    buffer_out, size_out, block, false);
+}
+
+/*
+ * Optimal parse for data decoded far more often than it is compressed, a
+ * little size is traded for tokens the decoder handles on its fast path.
+ */
+static unsigned int
+lzm_encode_opt_dspeed(
+    const struct lzm_state * const state,
+    const unsigned char * const base,
+    const unsigned char * const low,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out,
+    struct lzm_block * const block)
+{
+	return lzm_encode_opt_parse(state, base, low, buffer_in, size_in,
+	    buffer_out, size_out, block, true);
+}
+
+/*
+ * Table indices are relative to base.  Matches may reach back as far as low,
+ * which is below buffer_in when earlier data is kept as history.
+ */
+typedef unsigned int (*lzm_codec_func)(
+    const struct lzm_state * const state,
+    const unsigned char * const base,
+    const unsigned char * const low,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out,
+    struct lzm_block * const block);
+
+struct lzm_config {
+	lzm_codec_func	codec;
+	unsigned int	hash_order;
+	unsigned int	chain_order;
+	unsigned int	chain_length;
+	unsigned int	cache;
+};
+
+/*
+ * The orders are those for the reference caches (CACHE_REF_L*).  Levels
+ * naming a cache have their tables scaled to the one found on the host.
+ */
+__attribute__((aligned(64)))
+struct lzm_config lzm_encode_config[LZM_LEVEL_COUNT] = {
+	{ lzm_encode_none, 		 0,  0, 0, 0 },
+	{ lzm_encode_fast, HASH_ORDER_FAST,  0, 0, LZM_CACHE_L1 },
+	{ lzm_encode_high, HASH_ORDER_MID,   4, MAX_CHAIN_LENGTH, LZM_CACHE_L2 },
+	{ lzm_encode_high, HASH_ORDER_HIGH,  8, MAX_CHAIN_LENGTH, LZM_CACHE_L3 },
+	{ lzm_encode_high, HASH_ORDER_HIGH, 12, MAX_CHAIN_LENGTH, LZM_CACHE_L3 },
+	{ lzm_encode_high, HASH_ORDER_HIGH, 16, MAX_CHAIN_LENGTH, LZM_CACHE_L3 },
+	{ lzm_encode_bt,   HASH_ORDER_HIGH, 20, BT_DEPTH, 0 },
+	{ lzm_encode_bt,   HASH_ORDER_HIGH, 24, BT_DEPTH * 2, 0 },
+	{ lzm_encode_opt,  HASH_ORDER_HIGH, 20, 16, 0 },
+	{ lzm_encode_opt,  HASH_ORDER_HIGH, 24, 64, 0 },
+	{ lzm_encode_lazy, HASH_ORDER_LAZY,  0, 1, LZM_CACHE_L2 },
+	{ lzm_encode_lazy, HASH_ORDER_MID,   0, 2, LZM_CACHE_L2 },
+	{ lzm_encode_bucket, HASH_ORDER_BUCKET, 0, 1, LZM_CACHE_L2 },
+	{ lzm_encode_bucket, HASH_ORDER_BUCKET + 2, 0, 1, LZM_CACHE_L3 },
+	{ lzm_encode_dfast, HASH_ORDER_MID, 0, 0, LZM_CACHE_L2 },
+	{ lzm_encode_accel, HASH_ORDER_ACCEL, 0, 2, LZM_CACHE_L1 },
+	{ lzm_encode_accel, HASH_ORDER_ACCEL, 0, 3, LZM_CACHE_L1 },
+	{ lzm_encode_accel, HASH_ORDER_ACCEL - 1, 0, 4, LZM_CACHE_L1 },
+	{ lzm_encode_accel, HASH_ORDER_ACCEL - 1, 0, 6, LZM_CACHE_L1 },
+	{ lzm_encode_opt_dspeed, HASH_ORDER_HIGH, 20, 16, 0 },
+};
+
+static const unsigned int cache_ref[LZM_CACHE_COUNT] = {
+	0, CACHE_REF_L1, CACHE_REF_L2, CACHE_REF_L3
+};
+static unsigned int cache_detected[LZM_CACHE_COUNT];
+static unsigned int cache_override[LZM_CACHE_COUNT];
+static unsigned int cache_probed;
+
+static unsigned int
+cache_sysfs(const unsigned int index, const char * const name,
+    char * const buf, const unsigned int len)
+{
+	char path[64];
+	FILE *f;
+	unsigned int found;
+
+	snprintf(path, sizeof(path), CACHE_SYSFS "/index%u/%s", index, name);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return false;
+
+	found = (fgets(buf, len, f) != NULL);
+	fclose(f);
+
+	return found;
+}
+
+/*
+ * Data and unified caches of the first cpu as listed in sysfs, with cpuid
+ * leaf 4 (or its AMD equivalent) where sysfs is not available.
+ */
+static void
+cache_probe(unsigned int * const sizes)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	static const unsigned int leaves[] = { 4, 0x8000001D };
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int l;
+#endif
+	char buf[32];
+	char *unit;
+	unsigned long size;
+	unsigned int level;
+	unsigned int i;
+
+	for (i = 0; i < CACHE_INDEX_MAX; i++) {
+		if (!cache_sysfs(i, "level", buf, sizeof(buf)))
+			break;
+		level = strtoul(buf, NULL, 10);
+		if (!cache_sysfs(i, "type", buf, sizeof(buf)) ||
+		    strncmp(buf, "Instruction", 11) == 0)
+			continue;
+		if (!cache_sysfs(i, "size", buf, sizeof(buf)))
+			continue;
+		size = strtoul(buf, &unit, 10);
+		if (*unit == 'K')
+			size <<= 10;
+		else if (*unit == 'M')
+			size <<= 20;
+		if (level > 0 && level < LZM_CACHE_COUNT && sizes[level] == 0)
+			sizes[level] = MIN(size, UINT32_MAX);
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	for (l = 0; l < sizeof(leaves) / sizeof(leaves[0]); l++) {
+		if (sizes[LZM_CACHE_L1] != 0)
+			break;
+		if (__get_cpuid_max(leaves[l] & 0x80000000, NULL) < leaves[l])
+			continue;
+		for (i = 0; i < CACHE_INDEX_MAX; i++) {
+			__cpuid_count(leaves[l], i, eax, ebx, ecx, edx);
+			/* 0 ends the list, 2 is an instruction cache */
+			if ((eax & 0x1F) == 0)
+				break;
+			if ((eax & 0x1F) == 2)
+				continue;
+			level = (eax >> 5) & 0x7;
+			size = (unsigned long)(((ebx >> 22) & 0x3FF) + 1) *
+			    (((ebx >> 12) & 0x3FF) + 1) * ((ebx & 0xFFF) + 1) *
+			    (ecx + 1);
+			if (level > 0 && level < LZM_CACHE_COUNT &&
+			    sizes[level] == 0)
+				sizes[level] = MIN(size, UINT32_MAX);
+		}
+	}
+	(void)edx;
+#endif
+}
+
+unsigned int
+lzm_cache_size(const unsigned int cache)
+{
+	unsigned int sizes[LZM_CACHE_COUNT] = { 0 };
+
+	if (cache == 0 || cache >= LZM_CACHE_COUNT)
+		return 0;
+
+	if (cache_override[cache] != 0)
+		return cache_override[cache];
+
+	if (!cache_probed) {
+		cache_probe(sizes);
+		memcpy(cache_detected, sizes, sizeof(cache_detected));
+		cache_probed = true;
+	}
+
+	if (cache_detected[cache] != 0)
+		return cache_detected[cache];
+
+	return cache_ref[cache];
+}
+
+unsigned int
+lzm_set_cache_size(const unsigned int cache, const unsigned int size)
+{
+	if (cache == 0 || cache >= LZM_CACHE_COUNT)
+		return EINVAL;
+
+	cache_override[cache] = size;
+	return 0;
+}
+
+/*
+ * Table orders are moved by the number of halvings between the reference
+ * and actual cache, or doublings up to CACHE_GROW_MAX.  Larger tables cost
+ * more to reset and to fault in, so they gain less than smaller ones lose.
+ * The L3 is shared between cores and is only used to shrink.
+ */
+static int
+cache_scale(const unsigned int cache)
+{
+	const unsigned long ref = cache_ref[cache];
+	const unsigned long size = lzm_cache_size(cache);
+	const int grow = (cache == LZM_CACHE_L3) ? 0 : CACHE_GROW_MAX;
+	int scale = 0;
+
+	while (scale < grow && size >= ref << (scale + 1))
+		scale++;
+	while (scale <= 0 && scale > -CACHE_SHRINK_MAX &&
+	    size < ref >> -scale)
+		scale--;
+
+	return scale;
+}
+
+/*
+ * Bytes per chain slot, a bare link for the hash chains or a pair of children
+ * for the binary tree.
+ */
+static inline unsigned int
+lzm_chain_size(const struct lzm_state * const state)
+{
+	if (lzm_encode_config[state->level].codec == lzm_encode_bt)
+		return sizeof(*state->tree);
+
+	return sizeof(*state->chains);
+}
+
+static int
+lzm_malloc(void **addr, unsigned int size)
+{
+	int error;
+
+	error = posix_memalign(addr, MEM_ALIGN, size);
+	if (error != 0)
+		error = ENOMEM;
+
+	return error;
+}
+
+unsigned int
+lzm_encode_init(struct lzm_state ** const state, const unsigned int format,
     const unsigned int level)
 {
 	struct lzm_state *statep;
-	unsigned int ilevel = level;
-	int error = 0;
+	unsigned int ilevel = level;
+	int error = 0;
+	int scale;
+
+	*state = NULL;
+
+	if (format != LZM_FORMAT_1 && format != LZM_FORMAT_2)
+		return EINVAL;
+
+	if (ilevel == LZM_LEVEL_DEF)
+		ilevel = LZM_LEVEL_FAST;
+
+	if (ilevel >= LZM_LEVEL_COUNT)
+		return EINVAL;
+
+	error = lzm_malloc((void **)&statep, sizeof(*statep));
+	if (error != 0)
+		goto out;
+
+	statep->level = ilevel;
+	statep->format = format;
+	statep->hash_order = lzm_encode_config[statep->level].hash_order;
+	statep->chain_order = lzm_encode_config[statep->level].chain_order;
+	if (lzm_encode_config[statep->level].cache != 0) {
+		scale = cache_scale(lzm_encode_config[statep->level].cache);
+		statep->hash_order += scale;
+		if (statep->chain_order > 0)
+			statep->chain_order += scale;
+	}
+	statep->hash_buckets = (statep->hash_order > 0) ?
+	    1 << statep->hash_order : 0;
+	statep->prefetch = (sizeof(*statep->last_ht) << statep->hash_order) >
+	    lzm_cache_size(LZM_CACHE_L2);
+	statep->chain_mask = (1 << statep->chain_order) - 1;
+	statep->chain_length = lzm_encode_config[statep->level].chain_length;
+	statep->sample = LZM_SAMPLE_DEF;
+	statep->last_ht = NULL;
+	statep->chains = NULL;
+	statep->opt = NULL;
+	statep->window = NULL;
+	statep->dict = NULL;
+	statep->epoch = NULL;
+	statep->ldm = NULL;
+
+	error = lzm_malloc((void **)&statep->epoch, sizeof(*statep->epoch));
+	if (error != 0)
+		goto out;
+
+	statep->epoch->pos = 0;
+	statep->epoch->reset = true;
+
+	if (statep->hash_order > 0) {
+		error = lzm_malloc((void **)&statep->last_ht,
+		    sizeof(*statep->last_ht) << statep->hash_order);
+		if (error != 0)
+			goto out;
+	}
+
+	if (statep->chain_order > 0) {
+		error = lzm_malloc((void **)&statep->chains,
+		    lzm_chain_size(statep) << statep->chain_order);
+		if (error != 0)
+			goto out;
+	}
+
+	if (lzm_encode_config[statep->level].codec == lzm_encode_opt ||
+	    lzm_encode_config[statep->level].codec == lzm_encode_opt_dspeed) {
+		error = lzm_malloc((void **)&statep->opt,
+		    sizeof(*statep->opt));
+		if (error != 0)
+			goto out;
+	}
+
+	*state = statep;
+
+ out:
+	if (error != 0)
+		lzm_encode_finish(statep);
+
+	return error;
+}
+
+/*
+ * As lzm_encode_init() but successive calls to lzm_encode() form a single
+ * stream, with matches reaching up to window bytes back into earlier calls.
+ * The stream must be decoded in the same order by a state set up with
+ * lzm_decode_init_stream() and the same window.
+ */
+unsigned int
+lzm_encode_init_stream(struct lzm_state ** const state,
+    const unsigned int format, const unsigned int level,
+    const unsigned int window)
+{
+	int error;
+
+	error = lzm_encode_init(state, format, level);
+	if (error != 0)
+		return error;
+
+	error = lzm_window_init(&(*state)->window, window);
+	if (error != 0) {
+		lzm_encode_finish(*state);
+		*state = NULL;
+		return error;
+	}
+
+	(*state)->window->linked = true;
+	return 0;
+}
+
+/*
+ * As lzm_encode_init_stream() but also searching the whole window for long
+ * repeats, however far back they are.  The stream decodes as any other.
+ */
+unsigned int
+lzm_encode_init_long(struct lzm_state ** const state,
+    const unsigned int format, const unsigned int level,
+    const unsigned int window)
+{
+	struct lzm_ldm *ldm;
+	unsigned long seed = 0;
+	unsigned long z;
+	unsigned int i;
+	int error;
+
+	error = lzm_encode_init_stream(state, format, level, window);
+	if (error != 0)
+		return error;
+
+	error = lzm_malloc((void **)&ldm, sizeof(*ldm));
+	if (error != 0)
+		goto out;
+
+	(*state)->ldm = ldm;
+
+	ldm->table = calloc(1 << LDM_HASH_ORDER, sizeof(*ldm->table));
+	if (ldm->table == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+
+	/* splitmix64, any fixed set of well mixed values will do */
+	for (i = 0; i < 256; i++) {
+		seed += 0x9E3779B97F4A7C15;
+		z = seed;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+		ldm->gear[i] = z ^ (z >> 31);
+	}
+
+ out:
+	if (error != 0) {
+		lzm_encode_finish(*state);
+		*state = NULL;
+	}
+
+	return error;
+}
+
+/*
+ * As lzm_encode_init() but every call to lzm_encode() can also match against
+ * the dictionary.  It is loaded into the tables here, by compressing it, and
+ * the result is restored before each call.  The data must be decoded by a
+ * state from lzm_decode_init_dict() with the same dictionary.
+ */
+unsigned int
+lzm_encode_init_dict(struct lzm_state ** const state,
+    const unsigned int format, const unsigned int level,
+    const unsigned char * const dict, const unsigned int dict_size)
+{
+	struct lzm_block block = { NULL, REP_INIT, true };
+	struct lzm_state *statep;
+	struct lzm_window *w;
+	struct lzm_dict *d;
+	unsigned char *scratch;
+	unsigned int size;
+	int error;
 
-	*state = NULL;
+	error = lzm_encode_init(state, format, level);
+	if (error != 0)
+		return error;
 
-	/* Currently only support the one format */
-	if (format != LZM_FORMAT_1)
-		return EINVAL;
+	statep = *state;
 
-	if (ilevel == LZM_LEVEL_DEF)
-		ilevel = LZM_LEVEL_FAST;
+	error = lzm_window_dict(&statep->window, dict, dict_size);
+	if (error != 0)
+		goto out;
 
-	if (ilevel >= LZM_LEVEL_COUNT)
-		return EINVAL;
+	w = statep->window;
 
-	error = lzm_malloc((void **)&statep, sizeof(*statep));
+	/* Too small to load, calls reset the tables as usual */
+	if (dict_size <= 16 || statep->hash_buckets == 0)
+		goto out;
+
+	error = lzm_malloc((void **)&d, sizeof(*d));
 	if (error != 0)
 		goto out;
 
-	statep->level = ilevel;
-	statep->format = format;
-	statep->hash_order = lzm_encode_config[statep->level].hash_order;
-	statep->hash_buckets = 1 << statep->hash_order;
-	statep->chain_order = lzm_encode_config[statep->level].chain_order;
-	statep->chain_mask = (1 << statep->chain_order) - 1;
-	statep->last_ht = NULL;
-	statep->chains = NULL;
+	d->last_ht = NULL;
+	d->chains = NULL;
+	d->chain_bytes = 0;
+	statep->dict = d;
 
-	if (statep->hash_order > 0) {
-		error = lzm_malloc((void **)&statep->last_ht,
-		    sizeof(*statep->last_ht) << statep->hash_order);
-		if (error != 0)
-			goto out;
-	}
+	/* Room for the worst case, the output must not stop the priming */
+	size = lzm_encode_bound(dict_size);
+	error = lzm_malloc((void **)&scratch, size);
+	if (error != 0)
+		goto out;
+
+	block.lit_start = w->buf;
+	lzm_reset(statep, w->buf, w->buf);
+	error = lzm_encode_config[statep->level].codec(statep, w->buf, w->buf,
+	    w->buf, dict_size, scratch, &size, &block);
+	free(scratch);
+	if (error != 0)
+		goto out;
+
+	size = statep->hash_buckets * sizeof(*statep->last_ht);
+	error = lzm_malloc((void **)&d->last_ht, size);
+	if (error != 0)
+		goto out;
+	memcpy(d->last_ht, statep->last_ht, size);
 
 	if (statep->chain_order > 0) {
-		error = lzm_malloc((void **)&statep->chains,
-		    sizeof(*statep->chains) << statep->chain_order);
+		d->chain_bytes = MIN(dict_size, statep->chain_mask + 1) *
+		    lzm_chain_size(statep);
+		error = lzm_malloc((void **)&d->chains, d->chain_bytes);
 		if (error != 0)
 			goto out;
+		memcpy(d->chains, statep->chains, d->chain_bytes);
 	}
 
-	*state = statep;
-
  out:
-	if (error != 0)
+	if (error != 0) {
 		lzm_encode_finish(statep);
+		*state = NULL;
+	}
+
+	return error;
+}
+
+/*
+ * Identify a dictionary by its content (FNV-1a), so data is never decoded
+ * against the wrong one.
+ */
+unsigned int
+lzm_dict_id(const unsigned char * const dict, const unsigned int dict_size)
+{
+	unsigned int hash = 2166136261U;
+	unsigned int i;
+
+	for (i = 0; i < dict_size; i++)
+		hash = (hash ^ dict[i]) * 16777619U;
+
+	return hash;
+}
+
+static int
+dict_segment_score_cmp(const void * const a, const void * const b)
+{
+	const struct dict_segment * const sa = a;
+	const struct dict_segment * const sb = b;
+
+	if (sa->score != sb->score)
+		return (sa->score < sb->score) ? 1 : -1;
+
+	return (sa->index < sb->index) ? -1 : 1;
+}
+
+static int
+dict_segment_index_cmp(const void * const a, const void * const b)
+{
+	const struct dict_segment * const sa = a;
+	const struct dict_segment * const sb = b;
+
+	return (sa->index < sb->index) ? -1 : (sa->index > sb->index);
+}
+
+/*
+ * Credit every byte of the match that lies before the current sample to the
+ * segment holding it.
+ */
+static inline void
+lzm_train_credit(struct dict_segment * const segs,
+    const unsigned int from, const unsigned int to)
+{
+	unsigned int pos = from;
+	unsigned int next;
+
+	while (pos < to) {
+		next = MIN(to, (pos / DICT_SEGMENT + 1) * DICT_SEGMENT);
+		segs[pos / DICT_SEGMENT].score += next - pos;
+		pos = next;
+	}
+}
+
+/*
+ * Build a dictionary from count samples laid out back to back.  Each sample
+ * is greedily matched against the ones before it with the hash chain match
+ * finder, and the bytes each match copies from earlier samples credit the
+ * DICT_SEGMENT sized segments holding them.  The best scoring segments, kept
+ * in their original order, form the dictionary.  *dict_size is the space
+ * available on entry and the size of the dictionary on return.
+ */
+unsigned int
+lzm_train_dict(const unsigned char * const samples,
+    const unsigned int * const sizes, const unsigned int count,
+    unsigned char * const dict, unsigned int * const dict_size)
+{
+	struct lzm_state *state = NULL;
+	struct dict_segment *segs = NULL;
+	struct opt_match matches[OPT_NICE];
+	const unsigned char *start = samples;
+	const unsigned char *curr_in;
+	const unsigned char *match_end;
+	const unsigned char *last;
+	unsigned long total = 0;
+	unsigned int nsegs;
+	unsigned int nmatches;
+	unsigned int len;
+	unsigned int out;
+	unsigned int i;
+	int error;
+
+	if (samples == NULL || sizes == NULL || dict == NULL || count == 0)
+		return EINVAL;
+
+	for (i = 0; i < count; i++)
+		total += sizes[i];
+
+	if (total > STREAM_MAX_INPUT)
+		return EINVAL;
+
+	if (total <= *dict_size) {
+		memcpy(dict, samples, total);
+		*dict_size = total;
+		return 0;
+	}
+
+	error = lzm_encode_init(&state, LZM_FORMAT_1, DICT_TRAIN_LEVEL);
+	if (error != 0)
+		return error;
+
+	nsegs = howmany(total, DICT_SEGMENT);
+	segs = calloc(nsegs, sizeof(*segs));
+	if (segs == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nsegs; i++)
+		segs[i].index = i;
+
+	lzm_reset(state, samples, samples);
+
+	for (i = 0; i < count; i++) {
+		curr_in = start;
+		match_end = start + sizes[i] - 7;
+
+		while (sizes[i] > 16 && curr_in < match_end - 3) {
+			nmatches = lzm_opt_matches(state, samples, samples,
+			    curr_in, match_end, matches);
+			if (nmatches == 0) {
+				curr_in++;
+				continue;
+			}
+
+			len = matches[nmatches - 1].len;
+			last = curr_in - matches[nmatches - 1].off;
+			if (last < start) {
+				lzm_train_credit(segs, last - samples,
+				    MIN(last + len, start) - samples);
+			}
+
+			lzm_opt_insert(state, samples, curr_in + 1,
+			    curr_in + len);
+			curr_in += len;
+		}
+
+		start += sizes[i];
+	}
+
+	qsort(segs, nsegs, sizeof(*segs), dict_segment_score_cmp);
+
+	/* Keep the winners, then put them back in their original order */
+	for (i = 0; i < nsegs && segs[i].score > 0; i++) {
+		if ((i + 1) * DICT_SEGMENT > *dict_size)
+			break;
+	}
+	nsegs = i;
+
+	qsort(segs, nsegs, sizeof(*segs), dict_segment_index_cmp);
+
+	out = 0;
+	for (i = 0; i < nsegs; i++) {
+		len = MIN(DICT_SEGMENT, total - segs[i].index * DICT_SEGMENT);
+		memcpy(dict + out, samples + segs[i].index * DICT_SEGMENT, len);
+		out += len;
+	}
+
+	*dict_size = out;
+
+ out:
+	free(segs);
+	lzm_encode_finish(state);
 
 	return error;
 }
@@ -824,34 +2973,422 @@ lzm_encode_finish(const struct lzm_state * const state)
 			free(state->last_ht);
 		if (state->chains != NULL)
 			free(state->chains);
+		if (state->opt != NULL)
+			free(state->opt);
+		if (state->epoch != NULL)
+			free(state->epoch);
+		if (state->ldm != NULL) {
+			free(state->ldm->table);
+			free(state->ldm);
+		}
+		lzm_window_finish(state->window);
+		if (state->dict != NULL) {
+			free(state->dict->last_ht);
+			free(state->dict->chains);
+			free(state->dict);
+		}
 		free((void *)state);
 	}
 
 	return 0;
 }
 
+/*
+ * Set how repetitive the input must look for lzm_encode() to compress it
+ * rather than store it, as the percentage of sampled four byte sequences
+ * seen before in the sample.  0 always compresses.
+ */
+unsigned int
+lzm_encode_set_sample(struct lzm_state * const state,
+    const unsigned int percent)
+{
+	if (state == NULL || percent > 100)
+		return EINVAL;
+
+	state->sample = percent;
+
+	return 0;
+}
+
+/*
+ * Report the table sizes chosen for the state, as orders of two entries.
+ */
+unsigned int
+lzm_encode_orders(const struct lzm_state * const state,
+    unsigned int * const hash_order, unsigned int * const chain_order)
+{
+	if (state == NULL)
+		return EINVAL;
+
+	*hash_order = state->hash_order;
+	*chain_order = state->chain_order;
+
+	return 0;
+}
+
+/*
+ * Find long matches over the whole window by their anchors.  The input
+ * between them is encoded with the level's codec as usual.
+ */
+static unsigned int
+lzm_encode_long(
+    const struct lzm_state * const state,
+    const unsigned char * const base,
+    const unsigned char * const low,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out,
+    struct lzm_block * const block)
+{
+	const lzm_codec_func codec = lzm_encode_config[state->level].codec;
+	const unsigned long * const gear = state->ldm->gear;
+	struct ht_entry * const table = state->ldm->table;
+	const unsigned char * const end = buffer_in + size_in;
+	const unsigned char * const match_end = end - 7;
+	const unsigned char * const out_limit = buffer_out + *size_out;
+	const unsigned char *curr_in;
+	const unsigned char *anchor;
+	const unsigned char *seg = buffer_in;
+	const unsigned char *skip = buffer_in;
+	const unsigned char *last;
+	unsigned char *curr_out = buffer_out;
+	struct ht_entry *entry;
+	unsigned long hash = 0;
+	unsigned int check;
+	unsigned int size;
+	unsigned int len;
+	unsigned int off;
+	int error;
+
+	block->last = false;
+
+	/* Prime the hash with the history so anchors match earlier calls */
+	for (curr_in = MAX(low, buffer_in - LDM_MIN_MATCH);
+	    curr_in < buffer_in; curr_in++)
+		hash = (hash << 1) + gear[*curr_in];
+
+	for (; curr_in < end; curr_in++) {
+		hash = (hash << 1) + gear[*curr_in];
+		if (likely((hash >> (64 - LDM_SAMPLE_ORDER)) != 0))
+			continue;
+
+		anchor = curr_in + 1 - LDM_MIN_MATCH;
+		if (anchor < low)
+			continue;
+
+		entry = &table[(hash >> (64 - LDM_SAMPLE_ORDER -
+		    LDM_HASH_ORDER)) & ((1 << LDM_HASH_ORDER) - 1)];
+		check = hash >> 4;
+		last = entry->index + base;
+
+		/* Repeats within the codec's own window are left to it */
+		if (anchor >= skip && anchor < match_end &&
+		    entry->token == check && last >= low &&
+		    ((unsigned int)(anchor - last) - 1) <
+		    offset_limit(state->format) &&
+		    (unsigned int)(anchor - last) > state->chain_mask) {
+			len = matchlen(anchor, last, match_end);
+			off = matchlen_rev(anchor, last, seg, low);
+			len += off;
+			if (len >= LDM_MIN_MATCH) {
+				anchor -= off;
+				last -= off;
+
+				/* The regular codec takes what lies before */
+				if (anchor - seg > 16) {
+					size = out_limit - curr_out;
+					error = codec(state, base, low, seg,
+					    anchor - seg, curr_out, &size,
+					    block);
+					if (error != 0)
+						return error;
+					curr_out += size;
+				}
+
+				curr_out = output_match(curr_out,
+				    block->lit_start,
+				    anchor - block->lit_start, anchor - last,
+				    len, out_limit,
+				    (state->format == LZM_FORMAT_2) ?
+				    block->rep : NULL);
+				if (unlikely(curr_out == NULL))
+					return EOVERFLOW;
+
+				seg = anchor + len;
+				skip = seg;
+				block->lit_start = seg;
+			}
+		}
+
+		entry->index = anchor - base;
+		entry->token = check;
+	}
+
+	/* The rest, ending the stream */
+	block->last = true;
+	size = out_limit - curr_out;
+	if (end - seg > 16)
+		error = codec(state, base, low, seg, end - seg, curr_out,
+		    &size, block);
+	else
+		error = lzm_encode_none(state, base, low, seg, end - seg,
+		    curr_out, &size, block);
+	if (error != 0)
+		return error;
+
+	*size_out = curr_out + size - buffer_out;
+	return 0;
+}
+
+/*
+ * Estimate whether the input is worth compressing.  SAMPLE_SPANS spans of
+ * SAMPLE_SPAN bytes spread over the input are hashed four bytes at a time
+ * and every token seen before counted.  Data that compresses repeats a good
+ * share of its tokens, already compressed or encrypted data next to none.
+ * Returns true when fewer than percent % of the sampled tokens repeat.
+ */
+static inline unsigned int
+lzm_sample_skip(const unsigned char * const buffer_in,
+    const unsigned int size_in, const unsigned int percent)
+{
+	unsigned int seen[1 << SAMPLE_ORDER];
+	const unsigned char *span_in;
+	unsigned int stride;
+	unsigned int token;
+	unsigned int hashval;
+	unsigned int hits = 0;
+	unsigned int span;
+	unsigned int i;
+
+	memset(seen, 0, sizeof(seen));
+	stride = (size_in - SAMPLE_SPAN) / (SAMPLE_SPANS - 1);
+
+	for (span = 0; span < SAMPLE_SPANS; span++) {
+		span_in = buffer_in + span * stride;
+		for (i = 0; i < SAMPLE_SPAN - 3; i++) {
+			token = readmem32(span_in + i);
+			hashval = hash_high(token, SAMPLE_ORDER);
+			hits += (seen[hashval] == token);
+			seen[hashval] = token;
+		}
+	}
+
+	return hits * 100 < percent * SAMPLE_SPANS * (SAMPLE_SPAN - 3);
+}
+
+static inline unsigned int
+lzm_encode_codec(const struct lzm_state * const state,
+    const unsigned char * const base, const unsigned char * const low,
+    const unsigned char * const buffer_in, const unsigned int size_in,
+    unsigned char * const buffer_out, unsigned int * const size_out)
+{
+	const unsigned int size_limit = *size_out;
+	struct lzm_block block = { buffer_in, REP_INIT, true };
+	struct lzm_block none = block;
+	int error;
+
+	if (size_in <= 16)
+		return lzm_encode_none(state, base, low, buffer_in, size_in,
+		    buffer_out, size_out, &none);
+
+	/*
+	 * Input that looks incompressible is stored as it is, unless there is
+	 * history before it that the sample cannot see.
+	 */
+	if (state->sample != 0 && state->level != LZM_LEVEL_NONE &&
+	    state->ldm == NULL && low == buffer_in &&
+	    size_in >= SAMPLE_MIN_INPUT &&
+	    lzm_sample_skip(buffer_in, size_in, state->sample))
+		return lzm_encode_none(state, base, low, buffer_in, size_in,
+		    buffer_out, size_out, &none);
+
+	if (state->ldm != NULL)
+		error = lzm_encode_long(state, base, low, buffer_in, size_in,
+		    buffer_out, size_out, &block);
+	else
+		error = lzm_encode_config[state->level].codec(state, base,
+		    low, buffer_in, size_in, buffer_out, size_out, &block);
+
+	/*
+	 * Stored literals are never larger than lzm_compressed_size(), which
+	 * the unchecked codecs can pass.
+	 */
+	if (state->level != LZM_LEVEL_NONE && (error == EOVERFLOW ||
+	    (error == 0 && *size_out > lzm_compressed_size(size_in)))) {
+		*size_out = size_limit;
+		error = lzm_encode_none(state, base, low, buffer_in, size_in,
+		    buffer_out, size_out, &none);
+	}
+
+	return error;
+}
+
+/*
+ * Undo a call on a dictionary state.  The codecs only add the positions of
+ * the input, so hashing each of them again as its codec does finds every
+ * entry written, at a cost in line with the input rather than the tables.
+ * No codec adds a position whose token runs past the end.  A binary tree
+ * also relinks the nodes it passes, so all of it is copied back.
+ */
+static void
+lzm_dict_restore(const struct lzm_state * const state,
+    const unsigned char * const base, const unsigned char * const data,
+    const unsigned int size)
+{
+	const lzm_codec_func codec = lzm_encode_config[state->level].codec;
+	const struct lzm_dict * const d = state->dict;
+	const unsigned int order = state->hash_order;
+	const unsigned int * const chains = (const unsigned int *)d->chains;
+	const unsigned char * const end = data + size;
+	const unsigned char * const end32 = end - 3;
+	const unsigned char * const end64 = end - 7;
+	const unsigned char *p;
+	unsigned int slots;
+	unsigned int slot;
+	unsigned int h;
+
+	/* A table of up to four entries per input byte is quicker copied */
+	if (state->hash_buckets / 4 <= size) {
+		memcpy(state->last_ht, d->last_ht,
+		    state->hash_buckets * sizeof(*state->last_ht));
+	} else if (codec == lzm_encode_high || codec == lzm_encode_bt ||
+	    codec == lzm_encode_opt || codec == lzm_encode_opt_dspeed) {
+		for (p = data; p < end32; p++) {
+			h = hash_high(readmem32(p), order);
+			state->last_ht[h] = d->last_ht[h];
+		}
+	} else if (codec == lzm_encode_dfast) {
+		for (p = data; p < end64; p++) {
+			h = hash_lazy(readmem64(p), order - 1);
+			state->last_ht[h] = d->last_ht[h];
+			h = (1 << (order - 1)) + hash_long(readmem64(p),
+			    order - 1);
+			state->last_ht[h] = d->last_ht[h];
+		}
+	} else if (codec == lzm_encode_bucket) {
+		for (p = data; p < end64; p++) {
+			h = hash_lazy(readmem64(p), order - BUCKET_ORDER) <<
+			    BUCKET_ORDER;
+			memcpy(&state->last_ht[h], &d->last_ht[h],
+			    sizeof(*state->last_ht) << BUCKET_ORDER);
+		}
+	} else {
+		for (p = data; p < end64; p++) {
+			h = hash_lazy(readmem64(p), order);
+			state->last_ht[h] = d->last_ht[h];
+		}
+	}
+
+	if (d->chain_bytes == 0)
+		return;
+
+	if (codec == lzm_encode_bt) {
+		memcpy(state->tree, d->chains, d->chain_bytes);
+		return;
+	}
+
+	/* Chain links past the dictionary are written before they are read */
+	slots = d->chain_bytes / sizeof(*chains);
+	for (p = data; p < end; p++) {
+		slot = (p - base) & state->chain_mask;
+		if (slot < slots)
+			state->chains[slot] = chains[slot];
+	}
+}
+
+/*
+ * Stream mode.  The input is appended to the history window and compressed
+ * from there, so matches can reach back into the data of earlier calls, or
+ * into the dictionary.
+ */
+static unsigned int
+lzm_encode_stream(const struct lzm_state * const state,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in, unsigned char * const buffer_out,
+    unsigned int * const size_out)
+{
+	struct lzm_window * const w = state->window;
+	const unsigned char *data;
+	unsigned int prefix;
+	int error;
+
+	error = lzm_window_reserve(w, size_in, &prefix);
+	if (error != 0)
+		return error;
+
+	/* Restart the table indices long before they can wrap */
+	if (w->pos > STREAM_MAX_POS) {
+		w->pos = 0;
+		w->reset = true;
+	}
+
+	data = w->buf + w->used;
+	memcpy(w->buf + w->used, buffer_in, size_in);
+
+	if (size_in > 16 && state->dict == NULL &&
+	    (w->reset || !w->linked)) {
+		lzm_reset(state, w->buf - w->pos, data);
+		w->reset = false;
+	}
+
+	error = lzm_encode_codec(state, w->buf - w->pos, data - prefix, data,
+	    size_in, buffer_out, size_out);
+
+	if (size_in > 16 && state->dict != NULL)
+		lzm_dict_restore(state, w->buf - w->pos, data, size_in);
+
+	/* A dictionary is the same for every call, nothing more to keep */
+	if (!w->linked)
+		return error;
+
+	/*
+	 * The tables may now refer to data that is not kept, so they cannot
+	 * be trusted after a failure.
+	 */
+	if (error != 0)
+		w->reset = true;
+	else
+		w->used += size_in;
+
+	return error;
+}
+
 unsigned int
 lzm_encode(const struct lzm_state * const state,
     const unsigned char * const buffer_in,
     const unsigned int size_in, unsigned char * const buffer_out,
     unsigned int * const size_out)
 {
+	struct lzm_epoch * const e = state->epoch;
 	int error;
 
 	if (buffer_in == NULL || buffer_out == NULL)
 		return EINVAL;
 
-	if (size_in <= 16) {
-		error = lzm_encode_none(state, buffer_in, size_in,
+	if (state->window != NULL)
+		return lzm_encode_stream(state, buffer_in, size_in,
 		    buffer_out, size_out);
-	} else {
-		error = lzm_encode_config[state->level].codec(state,
+
+	if (size_in <= 16)
+		return lzm_encode_codec(state, buffer_in, buffer_in,
 		    buffer_in, size_in, buffer_out, size_out);
 
-		if (error == EOVERFLOW && state->level != LZM_LEVEL_NONE)
-			error = lzm_encode_none(state, buffer_in, size_in,
-			    buffer_out, size_out);
+	/* Restart the indices before they wrap or base is not an address */
+	if (e->reset || e->pos > STREAM_MAX_POS ||
+	    size_in > STREAM_MAX_POS - e->pos ||
+	    e->pos > (uintptr_t)buffer_in) {
+		e->pos = 0;
+		e->reset = false;
+		lzm_reset(state, buffer_in, buffer_in);
+	} else if ((sizeof(*state->last_ht) << state->hash_order) >>
+	    RESET_ORDER <= size_in) {
+		lzm_reset(state, buffer_in - e->pos, buffer_in);
 	}
 
+	error = lzm_encode_codec(state, buffer_in - e->pos, buffer_in,
+	    buffer_in, size_in, buffer_out, size_out);
+	e->pos += size_in;
+
 	return error;
 }
@@ -0,0 +1,109 @@
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lzm_int.h"
+
+/*
+ * Make room for length more bytes after the data in the window, sliding the
+ * most recent history down to the start of the buffer or growing it when
+ * that is not enough.  The number of bytes of history that will precede
+ * the new data is returned in prefix.
+ */
+int
+lzm_window_reserve(struct lzm_window * const w, const unsigned int length,
+    unsigned int * const prefix)
+{
+	unsigned char *buf;
+	unsigned int keep;
+	unsigned int size;
+
+	if (length > STREAM_MAX_INPUT)
+		return EINVAL;
+
+	keep = MIN(w->used, w->history);
+
+	if (length > w->size - w->used) {
+		w->pos += w->used - keep;
+		if (keep != 0)
+			memmove(w->buf, w->buf + w->used - keep, keep);
+		w->used = keep;
+	}
+
+	if (length > w->size - w->used) {
+		size = 2 * w->history + length;
+		if (posix_memalign((void **)&buf, MEM_ALIGN, size) != 0)
+			return ENOMEM;
+		if (w->buf != NULL) {
+			memcpy(buf, w->buf, w->used);
+			free(w->buf);
+		}
+		w->buf = buf;
+		w->size = size;
+	}
+
+	*prefix = keep;
+	return 0;
+}
+
+int
+lzm_window_init(struct lzm_window ** const window, const unsigned int history)
+{
+	struct lzm_window *w;
+
+	*window = NULL;
+
+	if (history == 0 || history > MAX_OFFSET)
+		return EINVAL;
+
+	w = calloc(1, sizeof(*w));
+	if (w == NULL)
+		return ENOMEM;
+
+	w->history = history;
+	w->reset = 1;
+	*window = w;
+
+	return 0;
+}
+
+void
+lzm_window_finish(struct lzm_window * const w)
+{
+	if (w != NULL) {
+		free(w->buf);
+		free(w);
+	}
+}
+
+/*
+ * Set up a window holding a fixed dictionary.
+ */
+int
+lzm_window_dict(struct lzm_window ** const window,
+    const unsigned char * const dict, const unsigned int dict_size)
+{
+	unsigned int prefix;
+	int error;
+
+	if (dict == NULL)
+		return EINVAL;
+
+	error = lzm_window_init(window, dict_size);
+	if (error != 0)
+		return error;
+
+	error = lzm_window_reserve(*window, dict_size, &prefix);
+	if (error != 0) {
+		lzm_window_finish(*window);
+		*window = NULL;
+		return error;
+	}
+
+	memcpy((*window)->buf, dict, dict_size);
+	(*window)->used = dict_size;
+
+	return 0;
+}